@@ -12,15 +12,25 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#define KILO_HAVE_MALLINFO2
+#include <malloc.h>
+#endif
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 //
 //
@@ -28,6 +38,20 @@
 //
 //
 #define KILO_TAB_STOP 8
+// Most bytes shown on one row of the hex view. Fewer are shown when the terminal is too narrow.
+#define KILO_HEX_ROW_BYTES 16
+// Unchanged lines shown around every hunk of the diff view
+#define KILO_DIFF_CONTEXT 3
+// Most edits looked for between two matching lines before the diff gives up and calls everything in between changed
+#define KILO_DIFF_MAX_COST 4096
+// Multi-cursor edits that can be undone with Ctrl-Z
+#define KILO_UNDO_LEVELS 32
+// Rows in each block of a row index when it's built. A block that inserts fill up to twice this is split.
+#define KILO_INDEX_BLOCK 512
+#define HL_HIGHLIGHT_NUMBERS (1<<0)
+#define HL_HIGHLIGHT_STRINGS (1<<1)
+// Color whole lines of a unified diff by their first character
+#define HL_HIGHLIGHT_DIFF (1<<2)
 #define KILO_VERSION "0.0.1"
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -44,12 +68,51 @@ enum editorKey {
     PAGE_DOWN
 };
 
+// Highlight class of every character in a row's render string
+enum editorHighlight {
+    HL_NORMAL = 0,
+    HL_COMMENT,
+    HL_MLCOMMENT,
+    HL_KEYWORD1,
+    HL_KEYWORD2,
+    HL_STRING,
+    HL_NUMBER,
+    HL_ADDED,
+    HL_REMOVED,
+    HL_HUNK
+};
+
+// Lexer state at the end of a row. A string continued with a trailing backslash is stored as its quote character.
+enum editorHighlightState {
+    HL_STATE_NORMAL = 0,
+    HL_STATE_COMMENT = 1
+};
+
 //
 //
 /************* data *************/
 //
 //
 
+struct editorSyntax {
+    char *filetype;
+    // Patterns to match the filename against. Patterns starting with '.' match the file extension.
+    char **filematch;
+    // Keywords ending with '|' are highlighted as types (HL_KEYWORD2)
+    char **keywords;
+    char *singleline_comment_start;
+    char *multiline_comment_start;
+    char *multiline_comment_end;
+    int flags;
+};
+
+// Text shared between rows after a copy or paste. Rows pointing at a rowShare never write to or free their chars and render themselves: they make a private copy before an edit, and the texts are freed together once no row uses any of them.
+struct rowShare {
+    int refs;
+    int ntexts;
+    char *texts[];
+};
+
 // Typedef allows us to refer to the type as erow instead of struct erow.
 // Data type for storing a row of text in our editor. (erow) = editor row
 typedef struct erow {
@@ -57,11 +120,78 @@ typedef struct erow {
     int rsize;
     char *chars;
     char *render;
+    // Set when the row is pure ASCII, so columns and bytes are the same thing and none of the UTF-8 decoding is needed
+    int ascii;
+    // Width of render on screen in columns
+    int rcols;
+    // Set when chars and render are shared with other rows
+    struct rowShare *share;
+    // Highlight class of every byte of render, and the lexer state at the end of the row that the next row starts from
+    unsigned char *hl;
+    int hl_state;
+    // Hash of chars, for telling whether the buffer is back to how it was saved
+    unsigned long long hash;
 } erow;
 
 
 struct termios orig_termios;
 
+// A cursor besides the main one (E.cx, E.cy), for making the same edit in many places at once
+struct editorCursor {
+    int cx, cy;
+};
+
+// A row as it was before a multi-cursor edit
+struct undoRow {
+    int at;
+    int size;
+    char *chars;
+};
+
+// What's needed to undo a multi-cursor edit: the rows it changed and where the cursors were
+struct undoRecord {
+    struct undoRow *rows;
+    int numrows;
+    struct editorCursor *cursors;
+    int numcursors;
+    int cx, cy;
+    // E.hash right after the edit. The rows only fit back in while the buffer is still exactly as the edit left it.
+    unsigned long long hash;
+};
+
+// A byte overwritten in hex view, waiting to be written back to the file
+struct hexPatch {
+    long long offset;
+    unsigned char byte;
+};
+
+// Rows start+1 to end collapsed into row start. before is how many rows the folds ahead of this one hide.
+struct foldRange {
+    int start, end;
+    int before;
+};
+
+// A run of consecutive rows in a row index, with the weight of each and their total
+struct indexBlock {
+    int count;
+    long long sum;
+    long long *w;
+};
+
+// A per-row weight, for mapping between rows and the running total of the weights. The weights are kept in blocks of consecutive rows, with Fenwick trees of the row counts and weight sums of the blocks, so finding a row or a total is O(log n) plus a scan of one block.
+// Inserting or deleting rows only shifts the weights inside their block, so edits anywhere in a huge file stay cheap. The index is built the first time it's needed, and built again after every weight changed at once.
+struct rowIndex {
+    struct indexBlock *blocks;
+    int numblocks;
+    int blockcap;
+    // Fenwick trees over the blocks. Splitting or removing blocks leaves them stale until the next lookup rebuilds them in O(blocks).
+    int *rows;
+    long long *sums;
+    int treevalid;
+    int built;
+    long long (*weight)(int at);
+};
+
 struct editorConfig {
     int cx, cy;
     int rx;
@@ -69,14 +199,60 @@ struct editorConfig {
     int rowoff;
     // horizontal scrolling
     int coloff;
+    // Soft wrap mode, in which rows are split over as many screen lines as they need instead of scrolling horizontally
+    int wrap;
+    // First visual line on screen in wrap mode, and how many lines of E.rowoff are above it
+    int vrowoff;
+    int vrowsub;
+    // Number of visual lines of every row when wrapped
+    struct rowIndex wrapidx;
+    // Bytes of every row including its newline, for converting between rows and byte offsets in the file
+    struct rowIndex byteidx;
     int screenrows;
     int screencols;
     int numrows;
     // Make E.row an array of erow structs. That way we can store multiple lines and will be a dynamically allocated array, so we'll make it a pointer to erow and initialize the pointer to NULL.
     erow *row;
-    // We call a text buffer "dirty" if it has been modified since opening or saving the file
+    // We call a text buffer "dirty" if it differs from the file as it was opened or last saved. It's worked out from content hashes, so undoing a change by hand makes the buffer clean again.
     int dirty;
+    // Sum of the hashes of every pair of neighbouring rows, and the same when the file was opened or saved
+    unsigned long long hash;
+    unsigned long long savedhash;
+    // Hash of every row in order when the file was opened or saved, for checking a match of E.hash
+    unsigned long long savedorder;
     char *filename;
+    struct editorSyntax *syntax;
+    // Rows 0 to hlrows-1 have up to date highlighting. Rows after that are highlighted lazily when they're drawn.
+    int hlrows;
+    // Selection mode (Ctrl-K): the selection runs from the anchor to the cursor
+    int selecting;
+    int selx, sely;
+    // Hex view (kilo -x, or a file with a NUL byte near the start). The file is mapped read-only instead of being read into rows, and only the bytes on screen are ever looked at.
+    int hex;
+    unsigned char *map;
+    long long mapsize;
+    // Cursor as a byte offset, and whether it's on the low nibble of that byte
+    long long hexcx;
+    int hexnibble;
+    // Offset of the first byte on screen, always at the start of a row
+    long long hexoff;
+    // Overwritten bytes sorted by offset. The mapping itself is never written to.
+    struct hexPatch *patches;
+    int numpatches;
+    int patchcap;
+    // For the diff buffer made by Ctrl-D, the buffer it's the diff of. -1 for every other buffer.
+    int diffof;
+    // Extra cursors (Ctrl-N/Ctrl-A), sorted by position and never on the main cursor
+    struct editorCursor *cursors;
+    int numcursors;
+    int cursorcap;
+    // Multi-cursor edits that Ctrl-Z can undo, the most recent last
+    struct undoRecord *undo;
+    int numundo;
+    // Collapsed folds (Ctrl-R), sorted and never overlapping
+    struct foldRange *folds;
+    int numfolds;
+    int foldcap;
     char statusmsg[80];
     time_t statusmsg_time;
     struct termios orig_termios;
@@ -84,6 +260,90 @@ struct editorConfig {
 
 struct editorConfig E;
 
+// Open buffers. The active buffer lives in E and buffers[curbuffer] is only filled in again when switching away from it.
+struct editorConfig *buffers = NULL;
+int numbuffers = 0;
+int curbuffer = 0;
+
+// Lines cut or copied with Ctrl-X/Ctrl-C. Shared by all buffers. The first and last line are the partial lines at the ends of the selection; the ones in between are whole rows.
+struct editorClipboard {
+    erow *rows;
+    int numrows;
+};
+
+struct editorClipboard clip = {NULL, 0};
+
+// Open every file in hex view (kilo -x)
+int force_hex = 0;
+
+// Set by the SIGWINCH handler and picked up while waiting for a key
+volatile sig_atomic_t winch_pending = 0;
+
+// Phases of a frame that we time when tracing. Input decode and edit happen in editorProcessKeypress, the rest in editorRefreshScreen.
+enum tracePhase {
+    TRACE_INPUT = 0,
+    TRACE_EDIT,
+    TRACE_SCROLL,
+    TRACE_DRAW,
+    TRACE_FLUSH,
+    TRACE_PHASES
+};
+
+struct editorTrace {
+    // Show frame time, bytes emitted and heap usage in the status bar (toggled with Ctrl-T)
+    int overlay;
+    // Chrome trace-event JSON file given by the KILO_TRACE environment variable, NULL if not tracing
+    FILE *fp;
+    int events;
+    // Monotonic timestamp that trace events are relative to
+    long long origin;
+    // Duration in microseconds of every phase of the last frame
+    long long phase[TRACE_PHASES];
+    // Duration and size of the last complete frame, shown by the overlay
+    long long frame_us;
+    int frame_bytes;
+};
+
+struct editorTrace trace;
+
+//
+//
+/************* filetypes *************/
+//
+//
+
+char *DIFF_HL_extensions[] = {".diff", ".patch", NULL};
+
+char *C_HL_extensions[] = {".c", ".h", ".cpp", ".hpp", ".cc", NULL};
+char *C_HL_keywords[] = {
+    "switch", "if", "while", "for", "break", "continue", "return", "else",
+    "struct", "union", "typedef", "static", "enum", "class", "case", "default",
+    "do", "goto", "sizeof", "const", "extern", "volatile", "register",
+
+    "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+    "void|", "short|", "size_t|", "ssize_t|", NULL
+};
+
+// Highlight database, one entry per supported filetype
+struct editorSyntax HLDB[] = {
+    {
+        "c",
+        C_HL_extensions,
+        C_HL_keywords,
+        "//", "/*", "*/",
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    },
+    {
+        "diff",
+        DIFF_HL_extensions,
+        NULL,
+        NULL, NULL, NULL,
+        HL_HIGHLIGHT_DIFF
+    },
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
 // Die function to print an error message and exit program
 void die(const char *s) {
     write(STDOUT_FILENO, "\x1b[2J", 4);
@@ -101,9 +361,66 @@ void die(const char *s) {
 // To fix error because we were trying to call the function before it was defined so we declare this function here which allows us to call the function before its defined
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
+void editorHandleResize();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+int editorRowHidden(int at);
+
+
+
+//
+//
+/************* trace *************/
+//
+//
+
+const char *trace_phase_names[TRACE_PHASES] = {"input", "edit", "scroll", "draw", "flush"};
+
+// Microseconds from the monotonic clock, so timings are not affected by changes to the wall clock
+long long traceNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Record the duration of a phase that began at start, and write it as a complete ("X") event if a trace file is open
+void traceRecord(int phase, long long start, int bytes) {
+    long long end = traceNow();
+    trace.phase[phase] = end - start;
+    if (!trace.fp) return;
+    fprintf(trace.fp, "%s\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":1",
+            trace.events ? "," : "", trace_phase_names[phase], start - trace.origin, end - start, (int)getpid());
+    if (bytes >= 0) fprintf(trace.fp, ",\"args\":{\"bytes\":%d}", bytes);
+    fputs("}", trace.fp);
+    trace.events++;
+}
+
+// Bytes currently allocated from the heap, or -1 if the C library can't tell us
+long traceHeapUsage() {
+#ifdef KILO_HAVE_MALLINFO2
+    struct mallinfo2 mi = mallinfo2();
+    return (long)mi.uordblks;
+#else
+    return -1;
+#endif
+}
 
+void traceClose() {
+    if (!trace.fp) return;
+    fputs("\n]}\n", trace.fp);
+    fclose(trace.fp);
+    trace.fp = NULL;
+}
 
+// Open the trace file named by KILO_TRACE. The JSON array is closed by traceClose when the program exits.
+void traceInit() {
+    trace.origin = traceNow();
+    char *path = getenv("KILO_TRACE");
+    if (path == NULL || path[0] == '\0') return;
+    trace.fp = fopen(path, "w");
+    if (!trace.fp) die("fopen");
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", trace.fp);
+    atexit(traceClose);
+}
 
 //
 //
@@ -155,13 +472,8 @@ void enableRawMode() {
 }
 
 
-int editorReadKey() {
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) die("read");
-    }
-
+// Turn the first byte of a keypress, plus any escape sequence following it, into a key
+int editorDecodeKey(char c) {
     if (c == '\x1b') {
         char seq[3];
 
@@ -205,8 +517,29 @@ int editorReadKey() {
         return '\x1b';
     }
     else {
-        return c;
+        // Bytes of multibyte UTF-8 characters come through one at a time, as values from 128 to 255
+        return (unsigned char)c;
+    }
+}
+
+int editorReadKey() {
+    int nread;
+    char c;
+    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+        if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+        // Redraw for the new size straight away rather than on the next key
+        if (winch_pending) {
+            winch_pending = 0;
+            editorHandleResize();
+            editorRefreshScreen();
+        }
     }
+
+    // Only time the decoding, not the time spent waiting for the user to press a key
+    long long start = traceNow();
+    int key = editorDecodeKey(c);
+    traceRecord(TRACE_INPUT, start, -1);
+    return key;
 }
 
 
@@ -246,195 +579,1570 @@ int getWindowSize(int *rows, int *cols) {
 
 //
 //
-/************* row operations *************/
+/************* utf-8 *************/
 //
 //
 
+// Check 16 bytes at a time for a byte with the high bit set. Most rows in the files we edit are ASCII, and those skip all the decoding below.
+int utf8IsAscii(const char *s, int len) {
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        if (_mm_movemask_epi8(v)) return 0;
+    }
+#endif
+    for (; i < len; i++)
+        if ((unsigned char)s[i] & 0x80) return 0;
+    return 1;
+}
 
-int editorRowCxToRx(erow *row, int cx) {
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++) {
-        // For each character, if it's a tab we use rx % KILO_TAB_STOP to find out how many columns we are to the right of the last tab stop, and then subtract that from KILO_TAB_STOP -1 to find out how many columns we are to the left of the next tab stop.
-        if (row->chars[j] == '\t')
-            rx += (KILO_TAB_STOP -1) - (rx % KILO_TAB_STOP);
-        rx++;
+int utf8IsContinuation(char c) {
+    return ((unsigned char)c & 0xC0) == 0x80;
+}
+
+// Decode the character at s into *cp and return how many bytes it takes. An invalid or truncated sequence is taken as a single byte.
+int utf8Decode(const char *s, int len, int *cp) {
+    unsigned char c = s[0];
+    int n, j;
+    if (c < 0x80) { *cp = c; return 1; }
+    else if ((c & 0xE0) == 0xC0) { n = 2; *cp = c & 0x1F; }
+    else if ((c & 0xF0) == 0xE0) { n = 3; *cp = c & 0x0F; }
+    else if ((c & 0xF8) == 0xF0) { n = 4; *cp = c & 0x07; }
+    else { *cp = c; return 1; }
+
+    if (n > len) { *cp = c; return 1; }
+    for (j = 1; j < n; j++) {
+        if (!utf8IsContinuation(s[j])) { *cp = c; return 1; }
+        *cp = (*cp << 6) | (s[j] & 0x3F);
     }
-    return rx;
+    return n;
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t')
-            cur_rx += (KILO_TAB_STOP -1) - (cur_rx %KILO_TAB_STOP);
-        cur_rx++;
+// Columns a character takes up on the terminal: 0 for combining marks, 2 for East Asian wide characters and emoji
+int utf8Width(int cp) {
+    if ((cp >= 0x0300 && cp <= 0x036F) || (cp >= 0x1AB0 && cp <= 0x1AFF) ||
+        (cp >= 0x1DC0 && cp <= 0x1DFF) || (cp >= 0x200B && cp <= 0x200F) ||
+        (cp >= 0x20D0 && cp <= 0x20FF) || (cp >= 0xFE20 && cp <= 0xFE2F))
+        return 0;
+    if ((cp >= 0x1100 && cp <= 0x115F) || (cp >= 0x2E80 && cp <= 0xA4CF && cp != 0x303F) ||
+        (cp >= 0xAC00 && cp <= 0xD7A3) || (cp >= 0xF900 && cp <= 0xFAFF) ||
+        (cp >= 0xFE30 && cp <= 0xFE4F) || (cp >= 0xFF00 && cp <= 0xFF60) ||
+        (cp >= 0xFFE0 && cp <= 0xFFE6) || (cp >= 0x1F300 && cp <= 0x1F64F) ||
+        (cp >= 0x1F900 && cp <= 0x1F9FF) || (cp >= 0x20000 && cp <= 0x3FFFD))
+        return 2;
+    return 1;
+}
 
-        if (cur_rx > rx) return cx;
+// Byte offset in render of the first character starting at or after screen column col
+int editorRenderColToByte(erow *row, int col) {
+    if (row->ascii) return col < row->rsize ? col : row->rsize;
+    int cur = 0;
+    int i = 0;
+    while (i < row->rsize && cur < col) {
+        int cp;
+        i += utf8Decode(&row->render[i], row->rsize - i, &cp);
+        cur += utf8Width(cp);
     }
-    return cx;
+    // Zero width characters belong with the character before them
+    while (i < row->rsize && cur == col && i > 0) {
+        int cp;
+        int n = utf8Decode(&row->render[i], row->rsize - i, &cp);
+        if (utf8Width(cp) != 0) break;
+        i += n;
+    }
+    return i;
 }
 
-// Function that uses the chars string of an erow to fill in the contents of the render string. We'll copy each character from chars to render. We won't worry about how to render tabs yet.
-void editorUpdateRow(erow *row) {
-    int tabs = 0;
-    int j;
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == '\t') tabs++;
-    free(row->render);
-    row->render = malloc(row->size + tabs*(KILO_TAB_STOP -1) + 1);
+// Screen column of byte offset at in render
+int editorRenderByteToCol(erow *row, int at) {
+    if (row->ascii) return at;
+    int col = 0;
+    int i = 0;
+    while (i < at) {
+        int cp;
+        i += utf8Decode(&row->render[i], row->rsize - i, &cp);
+        col += utf8Width(cp);
+    }
+    return col;
+}
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t'){
-            row->render[idx++] = ' ';
-            while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
-        } else {
-            row->render[idx++] = row->chars[j];
-        }
+// Byte offset in render where a piece starting at byte start and at most cols columns wide ends. Always takes at least one character, so a wide character is never split.
+int editorRenderFit(erow *row, int start, int cols) {
+    if (row->ascii) return start + cols < row->rsize ? start + cols : row->rsize;
+    int used = 0;
+    int i = start;
+    while (i < row->rsize) {
+        int cp;
+        int n = utf8Decode(&row->render[i], row->rsize - i, &cp);
+        int w = utf8Width(cp);
+        if (used + w > cols && i > start) break;
+        used += w;
+        i += n;
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
+    return i;
 }
 
+//
+//
+/************* syntax highlighting *************/
+//
+//
 
+int is_separator(int c) {
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
 
-void editorInsertRow(int at, char *s, size_t len) {
+// Fill in row->hl for the row's render string, starting in the lexer state the previous row ended in, and store the state this row ends in
+void editorUpdateSyntax(erow *row, int state) {
+    row->hl = realloc(row->hl, row->rsize + 1);
+    memset(row->hl, HL_NORMAL, row->rsize);
+    row->hl_state = HL_STATE_NORMAL;
+    if (E.syntax == NULL) return;
+
+    if (E.syntax->flags & HL_HIGHLIGHT_DIFF) {
+        int hl = HL_NORMAL;
+        if (row->rsize > 0 && row->render[0] == '+') hl = HL_ADDED;
+        else if (row->rsize > 0 && row->render[0] == '-') hl = HL_REMOVED;
+        else if (row->rsize > 0 && row->render[0] == '@') hl = HL_HUNK;
+        memset(row->hl, hl, row->rsize);
+        return;
+    }
 
-    if (at < 0 || at > E.numrows) return;
+    char **keywords = E.syntax->keywords;
+    char *scs = E.syntax->singleline_comment_start;
+    char *mcs = E.syntax->multiline_comment_start;
+    char *mce = E.syntax->multiline_comment_end;
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+
+    int prev_sep = 1;
+    int in_comment = state == HL_STATE_COMMENT;
+    int in_string = in_comment ? 0 : state;
+    int continued = 0;
+
+    int i = 0;
+    while (i < row->rsize) {
+        char c = row->render[i];
+        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+
+        if (scs_len && !in_string && !in_comment) {
+            if (!strncmp(&row->render[i], scs, scs_len)) {
+                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+                break;
+            }
+        }
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+        if (mcs_len && mce_len && !in_string) {
+            if (in_comment) {
+                row->hl[i] = HL_MLCOMMENT;
+                if (!strncmp(&row->render[i], mce, mce_len)) {
+                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+                    i += mce_len;
+                    in_comment = 0;
+                    prev_sep = 1;
+                } else {
+                    i++;
+                }
+                continue;
+            } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
+                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+                i += mcs_len;
+                in_comment = 1;
+                continue;
+            }
+        }
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+            if (in_string) {
+                row->hl[i] = HL_STRING;
+                // A backslash escapes the next character, or the newline if it's the last character of the row
+                if (c == '\\') {
+                    if (i + 1 < row->rsize) row->hl[i + 1] = HL_STRING;
+                    else continued = 1;
+                    i += 2;
+                    continue;
+                }
+                if (c == in_string) in_string = 0;
+                i++;
+                prev_sep = 1;
+                continue;
+            } else if (c == '"' || c == '\'') {
+                in_string = c;
+                row->hl[i] = HL_STRING;
+                i++;
+                continue;
+            }
+        }
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    editorUpdateRow(&E.row[at]);
+        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+            if ((isdigit((unsigned char)c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+                (c == '.' && prev_hl == HL_NUMBER)) {
+                row->hl[i] = HL_NUMBER;
+                i++;
+                prev_sep = 0;
+                continue;
+            }
+        }
 
-    E.numrows++;
-    E.dirty++;
-}
+        if (prev_sep) {
+            int j;
+            for (j = 0; keywords[j]; j++) {
+                int klen = strlen(keywords[j]);
+                int kw2 = keywords[j][klen - 1] == '|';
+                if (kw2) klen--;
+
+                if (!strncmp(&row->render[i], keywords[j], klen) &&
+                    is_separator(row->render[i + klen])) {
+                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+                    i += klen;
+                    break;
+                }
+            }
+            if (keywords[j] != NULL) {
+                prev_sep = 0;
+                continue;
+            }
+        }
 
-void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
-}
+        prev_sep = is_separator((unsigned char)c);
+        i++;
+    }
 
-void editorDelRow(int at) {
-    if (at < 0 || at >- E.numrows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    E.numrows--;
-    E.dirty++;
+    if (in_comment) row->hl_state = HL_STATE_COMMENT;
+    else if (in_string && continued) row->hl_state = in_string;
 }
 
+// Bring the highlighting of every row up to and including `at` up to date, continuing from the last row that was highlighted
+void editorHighlightRows(int at) {
+    if (E.syntax == NULL) return;
+    if (at >= E.numrows) at = E.numrows - 1;
+    while (E.hlrows <= at) {
+        int state = E.hlrows > 0 ? E.row[E.hlrows - 1].hl_state : HL_STATE_NORMAL;
+        editorUpdateSyntax(&E.row[E.hlrows], state);
+        E.hlrows++;
+    }
+}
 
-// Insert a single character into erow, at a given position
-void editorRowInsertChar(erow *row, int at, int c) {
-    if (at < 0 || at > row->size) at = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at+1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
+// Re-highlight a row whose text or starting state changed. Rows below it are only redone while the state it hands on keeps changing, and only as far as the screen: anything further down is left to editorHighlightRows.
+void editorSyntaxRowChanged(int at) {
+    if (E.syntax == NULL) return;
+    int j;
+    for (j = at; j < E.hlrows; j++) {
+        if (j >= E.rowoff + E.screenrows) {
+            E.hlrows = j;
+            break;
+        }
+        int old = E.row[j].hl_state;
+        editorUpdateSyntax(&E.row[j], j > 0 ? E.row[j - 1].hl_state : HL_STATE_NORMAL);
+        if (E.row[j].hl_state == old) break;
+    }
 }
 
-// When backspacing take current line and copy it to the previous line
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+int editorSyntaxToColor(int hl) {
+    switch (hl) {
+        case HL_COMMENT:
+        case HL_MLCOMMENT: return 36;
+        case HL_KEYWORD1: return 33;
+        case HL_KEYWORD2: return 32;
+        case HL_STRING: return 35;
+        case HL_NUMBER: return 31;
+        case HL_ADDED: return 32;
+        case HL_REMOVED: return 31;
+        case HL_HUNK: return 36;
+        default: return 37;
+    }
 }
 
-void editorRowDelChar(erow *row, int at) {
-    if (at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+// Pick the highlight rules for E.filename. Highlighting is worked out again lazily from the first row.
+void editorSelectSyntaxHighlight() {
+    E.syntax = NULL;
+    E.hlrows = 0;
+    if (E.filename == NULL) return;
+
+    char *ext = strrchr(E.filename, '.');
+
+    unsigned int j;
+    for (j = 0; j < HLDB_ENTRIES; j++) {
+        struct editorSyntax *s = &HLDB[j];
+        unsigned int i = 0;
+        while (s->filematch[i]) {
+            int is_ext = (s->filematch[i][0] == '.');
+            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+                (!is_ext && strstr(E.filename, s->filematch[i]))) {
+                E.syntax = s;
+                return;
+            }
+            i++;
+        }
+    }
 }
 
+void handleSigWinch(int sig) {
+    (void)sig;
+    winch_pending = 1;
+}
 
 //
 //
-/************* editor operations *************/
+/************* row index *************/
 //
 //
 
-void editorInsertChar(int c) {
-    // If cursor is on the tilde line after the end of the file, so append a new row to the file before isserting a character.
-    if (E.cy == E.numrows) {
-        editorInsertRow(E.numrows, "", 0);
-    }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+int lowbit(int i) {
+    return i & -i;
 }
 
-void editorInsertNewLine() {
-    if (E.cx == 0) {
-        editorInsertRow(E.cy, "", 0);
-    } else {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
-    }
-    E.cy++;
-    E.cx = 0;
+void indexInit(struct rowIndex *ix, long long (*weight)(int at)) {
+    ix->blocks = NULL;
+    ix->numblocks = 0;
+    ix->blockcap = 0;
+    ix->rows = NULL;
+    ix->sums = NULL;
+    ix->treevalid = 0;
+    ix->built = 0;
+    ix->weight = weight;
 }
 
-void editorDelChar() {
-    if (E.cy == E.numrows) return;
-    // If cursor at begining of first line there is nothing to do
-    if (E.cx == 0 && E.cy == 0) return;
+// Every weight changed, like the wrap widths on a resize. The index is built again the next time it's needed.
+void indexInvalidate(struct rowIndex *ix) {
+    int j;
+    for (j = 0; j < ix->numblocks; j++) free(ix->blocks[j].w);
+    ix->numblocks = 0;
+    ix->treevalid = 0;
+    ix->built = 0;
+}
 
-    erow *row = &E.row[E.cy];
-    if (E.cx > 0) {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
-    } else {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
+// Replace n blocks from block b on with blocks holding the `total` weights in w, KILO_INDEX_BLOCK to a block
+void indexSplice(struct rowIndex *ix, int b, int n, long long *w, int total) {
+    int add = (total + KILO_INDEX_BLOCK - 1) / KILO_INDEX_BLOCK;
+    int j, k;
+    for (j = b; j < b + n; j++) free(ix->blocks[j].w);
+    if (ix->numblocks - n + add >= ix->blockcap) {
+        ix->blockcap = (ix->numblocks - n + add) * 2 + 16;
+        ix->blocks = realloc(ix->blocks, sizeof(struct indexBlock) * ix->blockcap);
+        ix->rows = realloc(ix->rows, sizeof(int) * (ix->blockcap + 1));
+        ix->sums = realloc(ix->sums, sizeof(long long) * (ix->blockcap + 1));
+    }
+    memmove(&ix->blocks[b + add], &ix->blocks[b + n], sizeof(struct indexBlock) * (ix->numblocks - b - n));
+    ix->numblocks += add - n;
+    for (j = 0; j < add; j++) {
+        struct indexBlock *blk = &ix->blocks[b + j];
+        int left = total - j * KILO_INDEX_BLOCK;
+        blk->count = left < KILO_INDEX_BLOCK ? left : KILO_INDEX_BLOCK;
+        blk->w = malloc(sizeof(long long) * KILO_INDEX_BLOCK * 2);
+        memcpy(blk->w, &w[j * KILO_INDEX_BLOCK], sizeof(long long) * blk->count);
+        blk->sum = 0;
+        for (k = 0; k < blk->count; k++) blk->sum += blk->w[k];
     }
+    ix->treevalid = 0;
 }
 
-
-//
-//
-/************* file i/o *************/
-//
-//
-
-// Function that converts our array of erow structs into a single string that is ready to be written to a file
-char *editorRowsToString(int *buflen) {
-    int totlen = 0;
+void indexBuild(struct rowIndex *ix) {
+    if (ix->built) return;
+    long long *w = malloc(sizeof(long long) * (E.numrows + 1));
     int j;
-    for (j = 0; j < E.numrows; j++)
-        totlen += E.row[j].size + 1;
-    *buflen = totlen;
+    for (j = 0; j < E.numrows; j++) w[j] = ix->weight(j);
+    indexSplice(ix, 0, ix->numblocks, w, E.numrows);
+    free(w);
+    ix->built = 1;
+}
 
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (j = 0; j < E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+// Build the Fenwick trees over the blocks bottom up, each entry adding itself into the one above it
+void indexTree(struct rowIndex *ix) {
+    indexBuild(ix);
+    if (ix->treevalid) return;
+    int i;
+    for (i = 1; i <= ix->numblocks; i++) {
+        ix->rows[i] = ix->blocks[i - 1].count;
+        ix->sums[i] = ix->blocks[i - 1].sum;
     }
-    return buf;
+    for (i = 1; i <= ix->numblocks; i++) {
+        int up = i + lowbit(i);
+        if (up <= ix->numblocks) {
+            ix->rows[up] += ix->rows[i];
+            ix->sums[up] += ix->sums[i];
+        }
+    }
+    ix->treevalid = 1;
+}
+
+// Block b gained `rows` rows and `sum` weight
+void indexAdd(struct rowIndex *ix, int b, int rows, long long sum) {
+    if (!ix->treevalid) return;
+    int i;
+    for (i = b + 1; i <= ix->numblocks; i += lowbit(i)) {
+        ix->rows[i] += rows;
+        ix->sums[i] += sum;
+    }
+}
+
+// The block row `at` is in, and how far into it the row is. The row after the last one is at the end of the last block.
+int indexLocate(struct rowIndex *ix, int at, int *off) {
+    indexTree(ix);
+    int pos = 0;
+    int step = 1;
+    while (step * 2 <= ix->numblocks) step *= 2;
+    for (; step > 0; step >>= 1) {
+        if (pos + step <= ix->numblocks && ix->rows[pos + step] <= at) {
+            pos += step;
+            at -= ix->rows[pos];
+        }
+    }
+    if (pos == ix->numblocks && pos > 0) {
+        pos--;
+        at += ix->blocks[pos].count;
+    }
+    *off = at;
+    return pos;
+}
+
+// Sum of the weights of rows 0 to at-1
+long long indexPrefix(struct rowIndex *ix, int at) {
+    int off;
+    int b = indexLocate(ix, at, &off);
+    long long sum = 0;
+    int i;
+    for (i = b; i > 0; i -= lowbit(i)) sum += ix->sums[i];
+    for (i = 0; i < off; i++) sum += ix->blocks[b].w[i];
+    return sum;
+}
+
+// Work out the weights of rows from to to-1 again. Nothing is done before the index is first built, since the build gets them anyway.
+void indexRefresh(struct rowIndex *ix, int from, int to) {
+    if (!ix->built || from >= to) return;
+    int off;
+    int b = indexLocate(ix, from, &off);
+    for (; from < to && b < ix->numblocks; b++, off = 0) {
+        struct indexBlock *blk = &ix->blocks[b];
+        long long delta = 0;
+        for (; off < blk->count && from < to; off++, from++) {
+            long long w = ix->weight(from);
+            delta += w - blk->w[off];
+            blk->w[off] = w;
+        }
+        blk->sum += delta;
+        indexAdd(ix, b, 0, delta);
+    }
+}
+
+// The weight of row `at` changed but no rows moved
+void indexUpdate(struct rowIndex *ix, int at) {
+    indexRefresh(ix, at, at + 1);
+}
+
+// n rows were inserted at `at`, and their weights can be worked out. They go into the block they land in, which is split if that makes it too big.
+void indexInsert(struct rowIndex *ix, int at, int n) {
+    if (!ix->built || n <= 0) return;
+    if (ix->numblocks == 0) {
+        indexInvalidate(ix);
+        return;
+    }
+    int off;
+    int b = indexLocate(ix, at, &off);
+    struct indexBlock *blk = &ix->blocks[b];
+    int j;
+    if (blk->count + n <= KILO_INDEX_BLOCK * 2) {
+        memmove(&blk->w[off + n], &blk->w[off], sizeof(long long) * (blk->count - off));
+        long long sum = 0;
+        for (j = 0; j < n; j++) {
+            blk->w[off + j] = ix->weight(at + j);
+            sum += blk->w[off + j];
+        }
+        blk->count += n;
+        blk->sum += sum;
+        indexAdd(ix, b, n, sum);
+        return;
+    }
+    int total = blk->count + n;
+    long long *w = malloc(sizeof(long long) * total);
+    memcpy(w, blk->w, sizeof(long long) * off);
+    for (j = 0; j < n; j++) w[off + j] = ix->weight(at + j);
+    memcpy(&w[off + n], &blk->w[off], sizeof(long long) * (blk->count - off));
+    indexSplice(ix, b, 1, w, total);
+    free(w);
+}
+
+// n rows were deleted from `at`. Blocks they emptied are removed.
+void indexDelete(struct rowIndex *ix, int at, int n) {
+    if (!ix->built || n <= 0) return;
+    int off;
+    int b = indexLocate(ix, at, &off);
+    int first = b, empty = 0;
+    for (; n > 0 && b < ix->numblocks; b++, off = 0) {
+        struct indexBlock *blk = &ix->blocks[b];
+        int k = blk->count - off < n ? blk->count - off : n;
+        n -= k;
+        // Only the first and last blocks can be partly deleted, so the emptied ones are all together
+        if (k == blk->count) {
+            if (empty++ == 0) first = b;
+            continue;
+        }
+        long long sum = 0;
+        int j;
+        for (j = off; j < off + k; j++) sum += blk->w[j];
+        memmove(&blk->w[off], &blk->w[off + k], sizeof(long long) * (blk->count - off - k));
+        blk->count -= k;
+        blk->sum -= sum;
+        indexAdd(ix, b, -k, -sum);
+    }
+    if (empty) indexSplice(ix, first, empty, NULL, 0);
+}
+
+// Find the row that the running total `target` falls in, and how far into that row it is. Returns E.numrows if target is past the last row.
+int indexFind(struct rowIndex *ix, long long target, long long *rem) {
+    indexTree(ix);
+    int pos = 0;
+    int row = 0;
+    int step = 1;
+    while (step * 2 <= ix->numblocks) step *= 2;
+    for (; step > 0; step >>= 1) {
+        if (pos + step <= ix->numblocks && ix->sums[pos + step] <= target) {
+            pos += step;
+            target -= ix->sums[pos];
+            row += ix->rows[pos];
+        }
+    }
+    if (pos < ix->numblocks) {
+        struct indexBlock *blk = &ix->blocks[pos];
+        int i = 0;
+        while (i < blk->count && blk->w[i] <= target) target -= blk->w[i++];
+        row += i;
+    }
+    if (rem) *rem = target;
+    return row;
+}
+
+// Number of screen lines a row takes up in wrap mode. A wide character that doesn't fit at the end of a line moves to the next one, so non-ASCII rows have to be laid out to count them.
+long long editorWrapWeight(int at) {
+    if (editorRowHidden(at)) return 0;
+    erow *row = &E.row[at];
+    if (row->rcols == 0) return 1;
+    if (row->ascii) return (row->rcols + E.screencols - 1) / E.screencols;
+    long long lines = 0;
+    int start = 0;
+    while (start < row->rsize) {
+        start = editorRenderFit(row, start, E.screencols);
+        lines++;
+    }
+    return lines;
+}
+
+// Bytes a row takes up in the saved file
+long long editorByteWeight(int at) {
+    return E.row[at].size + 1;
+}
+
+// Which of its wrapped lines the cursor is on, and the cursor's column on that line. A cursor just past the end of a row that exactly fills its last line stays on that line.
+int editorWrapCursor(int *x) {
+    *x = E.rx;
+    if (E.cy >= E.numrows) return 0;
+    erow *row = &E.row[E.cy];
+    if (row->ascii) {
+        int sub = E.rx / E.screencols;
+        if (sub > 0 && sub == editorWrapWeight(E.cy)) sub--;
+        *x = E.rx - sub * E.screencols;
+        return sub;
+    }
+
+    int at = editorRenderColToByte(row, E.rx);
+    int sub = 0;
+    int start = 0;
+    while (1) {
+        int end = editorRenderFit(row, start, E.screencols);
+        if (at < end || end >= row->rsize) break;
+        start = end;
+        sub++;
+    }
+    *x = E.rx - editorRenderByteToCol(row, start);
+    return sub;
+}
+
+//
+//
+/************* folding *************/
+//
+//
+
+// Index of the last fold that starts at or before row `at`, or -1
+int editorFoldFind(int at) {
+    int lo = 0, hi = E.numfolds;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (E.folds[mid].start <= at) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo - 1;
+}
+
+// Whether row `at` is inside a collapsed fold. The first row of a fold stays on screen and stands in for the rest.
+int editorRowHidden(int at) {
+    int f = editorFoldFind(at);
+    return f >= 0 && at > E.folds[f].start && at <= E.folds[f].end;
+}
+
+// The fold that row `at` is the first row of, or -1
+int editorFoldHeader(int at) {
+    int f = editorFoldFind(at);
+    return f >= 0 && E.folds[f].start == at ? f : -1;
+}
+
+// Recount the rows hidden ahead of each fold after the list changed
+void editorFoldsChanged() {
+    int hidden = 0;
+    int j;
+    for (j = 0; j < E.numfolds; j++) {
+        E.folds[j].before = hidden;
+        hidden += E.folds[j].end - E.folds[j].start;
+    }
+}
+
+// The line row `at` is drawn on, counting from the top of the file with collapsed folds taking up one line. A hidden row gives the line of its fold.
+int editorVisibleIndex(int at) {
+    int f = editorFoldFind(at);
+    if (f < 0) return at;
+    struct foldRange *fold = &E.folds[f];
+    if (at <= fold->end) return fold->start - fold->before;
+    return at - fold->before - (fold->end - fold->start);
+}
+
+// The row drawn on line v, the other way round from editorVisibleIndex. Lines past the end of the file carry on counting from the last row.
+int editorVisibleRow(int v) {
+    int lo = 0, hi = E.numfolds;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (E.folds[mid].start - E.folds[mid].before <= v) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) return v;
+    struct foldRange *fold = &E.folds[lo - 1];
+    if (v == fold->start - fold->before) return fold->start;
+    return v + fold->before + (fold->end - fold->start);
+}
+
+// The row below `at` on screen, skipping over the fold `at` is the first row of
+int editorNextVisibleRow(int at) {
+    int f = editorFoldHeader(at);
+    return f >= 0 ? E.folds[f].end + 1 : at + 1;
+}
+
+// The row above `at` on screen. Moving up onto a collapsed fold lands on its first row.
+int editorPrevVisibleRow(int at) {
+    int f = editorFoldFind(at - 1);
+    if (f >= 0 && at - 1 <= E.folds[f].end) return E.folds[f].start;
+    return at - 1;
+}
+
+// Open fold f. Its rows take up screen lines again in wrap mode.
+void editorFoldRemove(int f) {
+    struct foldRange fold = E.folds[f];
+    memmove(&E.folds[f], &E.folds[f + 1], sizeof(struct foldRange) * (E.numfolds - f - 1));
+    E.numfolds--;
+    editorFoldsChanged();
+    indexRefresh(&E.wrapidx, fold.start, fold.end + 1);
+}
+
+// Collapse rows start+1 to end into row start. Folds it overlaps are merged into it. Returns the index of the new fold.
+int editorFoldAdd(int start, int end) {
+    // The folds are sorted and don't overlap, so the ones this overlaps come right before the first one starting after end
+    int last = editorFoldFind(end);
+    int first = last + 1;
+    while (first > 0 && E.folds[first - 1].end >= start) {
+        first--;
+        if (E.folds[first].start < start) start = E.folds[first].start;
+        if (E.folds[first].end > end) end = E.folds[first].end;
+    }
+    if (first > last) {
+        if (E.numfolds == E.foldcap) {
+            E.foldcap = E.foldcap ? E.foldcap * 2 : 16;
+            E.folds = realloc(E.folds, sizeof(struct foldRange) * E.foldcap);
+        }
+        memmove(&E.folds[first + 1], &E.folds[first], sizeof(struct foldRange) * (E.numfolds - first));
+        E.numfolds++;
+    } else {
+        memmove(&E.folds[first + 1], &E.folds[last + 1], sizeof(struct foldRange) * (E.numfolds - last - 1));
+        E.numfolds -= last - first;
+    }
+    E.folds[first].start = start;
+    E.folds[first].end = end;
+    editorFoldsChanged();
+    indexRefresh(&E.wrapidx, start, end + 1);
+    return first;
+}
+
+// Keep folds on the same rows when n rows were inserted at `at`, or -n rows deleted from there. A fold that rows are inserted into or deleted from is opened.
+// This runs after the rows went into the wrap index, which weighed them against folds that hadn't moved yet, so their weights are worked out again along with those of the rows of opened folds.
+void editorFoldsShift(int at, int n) {
+    if (E.numfolds == 0) return;
+    int past = n > 0 ? at : at - n;
+    // Rows of the opened folds, as they were before the change
+    int from = -1, to = -1;
+    int j, k = 0;
+    for (j = 0; j < E.numfolds; j++) {
+        struct foldRange fold = E.folds[j];
+        if (fold.start >= past) {
+            fold.start += n;
+            fold.end += n;
+        } else if (fold.end >= at) {
+            if (from < 0) from = fold.start;
+            to = fold.end;
+            continue;
+        }
+        E.folds[k++] = fold;
+    }
+    E.numfolds = k;
+    editorFoldsChanged();
+    if (n > 0) indexRefresh(&E.wrapidx, at, at + n);
+    if (from >= 0) {
+        // A fold whose first row was deleted has the rest of its rows moved up to `at`
+        if (from > at) from = at;
+        to += (n > 0 ? n : 0) + 1;
+        indexRefresh(&E.wrapidx, from, to < E.numrows ? to : E.numrows);
+    }
+}
+
+// Leading whitespace of a row in screen columns, or -1 if the row is blank
+int editorRowIndent(erow *row) {
+    int j = 0;
+    while (j < row->rsize && row->render[j] == ' ') j++;
+    return j == row->rsize ? -1 : j;
+}
+
+// Work out the indentation block to fold at row `at`: the rows below it that are indented deeper, or if there are none, the block `at` itself is in. Blocks are only found when they're folded, by scanning from their first row until the indentation drops back. Blank rows belong to a block unless they're at its end, and a closing bracket lined up with the first row is folded along with it.
+int editorIndentFold(int at, int *start, int *end) {
+    int level = editorRowIndent(&E.row[at]);
+    int next = at + 1;
+    while (next < E.numrows && editorRowIndent(&E.row[next]) < 0) next++;
+    int below = next < E.numrows ? editorRowIndent(&E.row[next]) : -1;
+
+    int head = at;
+    if (level < 0 || below <= level) {
+        if (level < 0) level = below;
+        for (head = at - 1; head >= 0; head--) {
+            int indent = editorRowIndent(&E.row[head]);
+            if (indent >= 0 && indent < level) break;
+        }
+        if (head < 0) return 0;
+    }
+
+    int hlevel = editorRowIndent(&E.row[head]);
+    int last = head;
+    int j;
+    for (j = head + 1; j < E.numrows; j++) {
+        int indent = editorRowIndent(&E.row[j]);
+        if (indent < 0) continue;
+        if (indent <= hlevel) break;
+        last = j;
+    }
+    if (j < E.numrows && editorRowIndent(&E.row[j]) == hlevel) {
+        char c = E.row[j].render[hlevel];
+        if (c == '}' || c == ']' || c == ')') last = j;
+    }
+    if (last == head) return 0;
+    *start = head;
+    *end = last;
+    return 1;
+}
+
+// Ctrl-R: collapse the selected rows, or the indentation block at the cursor, into their first row. On the first row of a collapsed fold it opens it again.
+void editorToggleFold() {
+    if (E.cy >= E.numrows) return;
+    int f = editorFoldHeader(E.cy);
+    if (f >= 0) {
+        int n = E.folds[f].end - E.folds[f].start;
+        editorFoldRemove(f);
+        editorSetStatusMessage("Unfolded %d lines", n);
+        return;
+    }
+
+    int start, end;
+    if (E.selecting) {
+        start = E.sely < E.cy ? E.sely : E.cy;
+        end = E.sely < E.cy ? E.cy : E.sely;
+        if (end >= E.numrows) end = E.numrows - 1;
+        E.selecting = 0;
+    } else if (!editorIndentFold(E.cy, &start, &end)) {
+        start = end = E.cy;
+    }
+    if (end <= start) {
+        editorSetStatusMessage("Nothing to fold here");
+        return;
+    }
+
+    f = editorFoldAdd(start, end);
+    E.cy = E.folds[f].start;
+    if (E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+    while (E.cx > 0 && utf8IsContinuation(E.row[E.cy].chars[E.cx])) E.cx--;
+    editorSetStatusMessage("Folded %d lines", E.folds[f].end - E.folds[f].start);
+}
+
+//
+//
+/************* content hash *************/
+//
+//
+
+// Stand-ins for the rows before the first row and after the last one
+#define HASH_START 0x6b696c6f73746172ULL
+#define HASH_END 0x6b696c6f656e6421ULL
+
+// 64-bit FNV-1a
+unsigned long long hashBytes(const char *s, int len) {
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    int j;
+    for (j = 0; j < len; j++) {
+        h ^= (unsigned char)s[j];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Hash of a row following another one. The splitmix64 finalizer spreads it over all the bits, so that sums of these don't cancel out.
+unsigned long long hashLink(unsigned long long a, unsigned long long b) {
+    unsigned long long x = (a * 0x9e3779b97f4a7c15ULL) ^ b;
+    x ^= x >> 31;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+unsigned long long editorRowHash(int at) {
+    if (at < 0) return HASH_START;
+    if (at >= E.numrows) return HASH_END;
+    return E.row[at].hash;
+}
+
+// Sum of links from to `to`, where link i joins row i-1 to row i and link E.numrows joins the last row to the end. E.hash is the sum of all of them.
+// Changing rows only changes the links next to them, so an edit takes the old links out of E.hash before it and puts the new ones in after it.
+unsigned long long editorLinkHashes(int from, int to) {
+    unsigned long long sum = 0;
+    int j;
+    for (j = from; j <= to; j++) sum += hashLink(editorRowHash(j - 1), editorRowHash(j));
+    return sum;
+}
+
+// Hash of all the rows in order. It takes a pass over every row, so it's only worked out when E.hash matches the saved hash.
+unsigned long long editorOrderHash() {
+    unsigned long long h = HASH_START;
+    int j;
+    for (j = 0; j < E.numrows; j++) h = hashLink(h, E.row[j].hash);
+    return hashLink(h, HASH_END);
+}
+
+// Work out E.dirty after an edit. A sum that matches the saved one isn't enough on its own: different orders of the same rows can have the same neighbouring pairs, like swapping the two declarations in "" "int a;" "" "int b;" "". So the rows are hashed in order to confirm the match.
+void editorUpdateDirty() {
+    E.dirty = E.hash != E.savedhash || editorOrderHash() != E.savedorder;
+}
+
+// Remember the buffer as it is on disk
+void editorMarkSaved() {
+    E.savedhash = E.hash;
+    E.savedorder = editorOrderHash();
+    E.dirty = 0;
+}
+
+//
+//
+/************* row operations *************/
+//
+//
+
+
+int editorRowCxToRx(erow *row, int cx) {
+    int rx = 0;
+    int j;
+    if (row->ascii) {
+        for (j = 0; j < cx; j++) {
+            // For each character, if it's a tab we use rx % KILO_TAB_STOP to find out how many columns we are to the right of the last tab stop, and then subtract that from KILO_TAB_STOP -1 to find out how many columns we are to the left of the next tab stop.
+            if (row->chars[j] == '\t')
+                rx += (KILO_TAB_STOP -1) - (rx % KILO_TAB_STOP);
+            rx++;
+        }
+        return rx;
+    }
+
+    // Same thing a character at a time, where a character can be several bytes and zero to two columns wide
+    j = 0;
+    while (j < cx) {
+        int cp;
+        if (row->chars[j] == '\t') {
+            rx += (KILO_TAB_STOP -1) - (rx % KILO_TAB_STOP) + 1;
+            j++;
+        } else {
+            j += utf8Decode(&row->chars[j], row->size - j, &cp);
+            rx += utf8Width(cp);
+        }
+    }
+    return rx;
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+    int cur_rx = 0;
+    int cx;
+    if (row->ascii) {
+        for (cx = 0; cx < row->size; cx++) {
+            if (row->chars[cx] == '\t')
+                cur_rx += (KILO_TAB_STOP -1) - (cur_rx %KILO_TAB_STOP);
+            cur_rx++;
+
+            if (cur_rx > rx) return cx;
+        }
+        return cx;
+    }
+
+    cx = 0;
+    while (cx < row->size) {
+        int cp, n = 1;
+        if (row->chars[cx] == '\t') {
+            cur_rx += (KILO_TAB_STOP -1) - (cur_rx % KILO_TAB_STOP) + 1;
+        } else {
+            n = utf8Decode(&row->chars[cx], row->size - cx, &cp);
+            cur_rx += utf8Width(cp);
+        }
+
+        if (cur_rx > rx) return cx;
+        cx += n;
+    }
+    return cx;
+}
+
+// Function that uses the chars string of an erow to fill in the contents of the render string. We'll copy each character from chars to render. We won't worry about how to render tabs yet.
+// This only touches the row itself, so it also works on rows that aren't in E.row, like the ones in the clipboard.
+void editorRenderRow(erow *row) {
+    int tabs = 0;
+    int j;
+    for (j = 0; j < row->size; j++)
+        if (row->chars[j] == '\t') tabs++;
+    free(row->render);
+    row->render = malloc(row->size + tabs*(KILO_TAB_STOP -1) + 1);
+    row->ascii = utf8IsAscii(row->chars, row->size);
+
+    int idx = 0;
+    if (row->ascii) {
+        for (j = 0; j < row->size; j++) {
+            if (row->chars[j] == '\t'){
+                row->render[idx++] = ' ';
+                while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
+            } else {
+                row->render[idx++] = row->chars[j];
+            }
+        }
+        row->rcols = idx;
+    } else {
+        // Tab stops are counted in screen columns, which no longer match bytes
+        int col = 0;
+        j = 0;
+        while (j < row->size) {
+            if (row->chars[j] == '\t') {
+                row->render[idx++] = ' ';
+                col++;
+                while (col % KILO_TAB_STOP != 0) {
+                    row->render[idx++] = ' ';
+                    col++;
+                }
+                j++;
+            } else {
+                int cp;
+                int n = utf8Decode(&row->chars[j], row->size - j, &cp);
+                memcpy(&row->render[idx], &row->chars[j], n);
+                idx += n;
+                j += n;
+                col += utf8Width(cp);
+            }
+        }
+        row->rcols = col;
+    }
+    row->render[idx] = '\0';
+    row->rsize = idx;
+    row->hash = hashBytes(row->chars, row->size);
+}
+
+void editorUpdateRow(erow *row) {
+    int at = row - E.row;
+    unsigned long long old = row->hash;
+    E.hash -= editorLinkHashes(at, at + 1);
+    editorRenderRow(row);
+    E.hash += editorLinkHashes(at, at + 1);
+    indexUpdate(&E.wrapidx, at);
+    indexUpdate(&E.byteidx, at);
+    editorSyntaxRowChanged(at);
+    // A row rebuilt with the same text leaves the buffer as clean or dirty as it was
+    if (row->hash != old) editorUpdateDirty();
+}
+
+
+
+void editorInsertRow(int at, char *s, size_t len) {
+
+    if (at < 0 || at > E.numrows) return;
+
+    E.hash -= editorLinkHashes(at, at);
+    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+    E.numrows++;
+
+    E.row[at].size = len;
+    E.row[at].chars = malloc(len + 1);
+    memcpy(E.row[at].chars, s, len);
+    E.row[at].chars[len] = '\0';
+
+    E.row[at].rsize = 0;
+    E.row[at].render = NULL;
+    E.row[at].share = NULL;
+    E.row[at].hl = NULL;
+    // The row below was highlighted following the row above, so that's the state to compare against when the new row is highlighted
+    E.row[at].hl_state = at > 0 ? E.row[at - 1].hl_state : HL_STATE_NORMAL;
+    if (at < E.hlrows) E.hlrows++;
+    // Link the row in with a placeholder hash, which editorUpdateRow replaces with the real one
+    E.row[at].hash = 0;
+    E.hash += editorLinkHashes(at, at + 1);
+    // Likewise it goes into the indexes as an empty row until it's rendered
+    E.row[at].rcols = 0;
+    indexInsert(&E.wrapidx, at, 1);
+    indexInsert(&E.byteidx, at, 1);
+    editorFoldsShift(at, 1);
+    editorUpdateRow(&E.row[at]);
+}
+
+// Drop a reference to shared texts, freeing all of them once no row refers to any of them
+void editorReleaseShare(struct rowShare *share) {
+    if (--share->refs > 0) return;
+    int j;
+    for (j = 0; j < share->ntexts; j++) free(share->texts[j]);
+    free(share);
+}
+
+void editorFreeRow(erow *row) {
+    if (row->share) {
+        editorReleaseShare(row->share);
+    } else {
+        free(row->render);
+        free(row->chars);
+    }
+    free(row->hl);
+}
+
+// Give a row its own copy of its text before it's edited in place. The render string is rebuilt by the edit anyway.
+void editorRowUnshare(erow *row) {
+    if (row->share == NULL) return;
+    char *chars = malloc(row->size + 1);
+    memcpy(chars, row->chars, row->size + 1);
+    editorReleaseShare(row->share);
+    row->share = NULL;
+    row->chars = chars;
+    row->render = NULL;
+}
+
+// Make dst[0..n-1] copies of src[0..n-1] that share the same text, instead of copying every line. Rows that aren't shared yet are put in a single new rowShare together.
+void editorShareRows(erow *src, erow *dst, int n) {
+    int j, unshared = 0;
+    for (j = 0; j < n; j++)
+        if (src[j].share == NULL) unshared++;
+
+    struct rowShare *share = NULL;
+    if (unshared) {
+        share = malloc(sizeof(struct rowShare) + sizeof(char *) * unshared * 2);
+        share->refs = 0;
+        share->ntexts = 0;
+    }
+    for (j = 0; j < n; j++) {
+        if (src[j].share == NULL) {
+            share->texts[share->ntexts++] = src[j].chars;
+            share->texts[share->ntexts++] = src[j].render;
+            src[j].share = share;
+            share->refs++;
+        }
+        dst[j] = src[j];
+        dst[j].share->refs++;
+        dst[j].hl = NULL;
+    }
+}
+
+// Splice n complete rows into E.row at `at` with a single memmove. The rows' records are taken over as they are, without copying their text.
+void editorInsertRows(int at, erow *rows, int n) {
+    if (at < 0 || at > E.numrows || n <= 0) return;
+    E.hash -= editorLinkHashes(at, at);
+    E.row = realloc(E.row, sizeof(erow) * (E.numrows + n));
+    memmove(&E.row[at + n], &E.row[at], sizeof(erow) * (E.numrows - at));
+    memcpy(&E.row[at], rows, sizeof(erow) * n);
+    E.numrows += n;
+    E.hash += editorLinkHashes(at, at + n);
+    indexInsert(&E.wrapidx, at, n);
+    indexInsert(&E.byteidx, at, n);
+    editorFoldsShift(at, n);
+    if (at < E.hlrows) E.hlrows = at;
+    editorUpdateDirty();
+}
+
+// Remove n rows at `at` with a single memmove. If out isn't NULL the row records are moved there instead of being freed.
+void editorDelRows(int at, int n, erow *out) {
+    if (at < 0 || n <= 0 || at + n > E.numrows) return;
+    E.hash -= editorLinkHashes(at, at + n);
+    if (out) {
+        memcpy(out, &E.row[at], sizeof(erow) * n);
+    } else {
+        int j;
+        for (j = 0; j < n; j++) editorFreeRow(&E.row[at + j]);
+    }
+    memmove(&E.row[at], &E.row[at + n], sizeof(erow) * (E.numrows - at - n));
+    E.numrows -= n;
+    E.hash += editorLinkHashes(at, at);
+    indexDelete(&E.wrapidx, at, n);
+    indexDelete(&E.byteidx, at, n);
+    editorFoldsShift(at, -n);
+    if (at < E.hlrows) E.hlrows = at;
+    editorUpdateDirty();
+}
+
+void editorDelRow(int at) {
+    if (at < 0 || at >= E.numrows) return;
+    E.hash -= editorLinkHashes(at, at + 1);
+    editorFreeRow(&E.row[at]);
+    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+    E.numrows--;
+    E.hash += editorLinkHashes(at, at);
+    indexDelete(&E.wrapidx, at, 1);
+    indexDelete(&E.byteidx, at, 1);
+    editorFoldsShift(at, -1);
+    // The row that moved up now follows a different row
+    if (at < E.hlrows) {
+        E.hlrows--;
+        editorSyntaxRowChanged(at);
+    }
+    editorUpdateDirty();
+}
+
+
+// Insert a single character into erow, at a given position
+void editorRowInsertChar(erow *row, int at, int c) {
+    if (at < 0 || at > row->size) at = row->size;
+    editorRowUnshare(row);
+    row->chars = realloc(row->chars, row->size + 2);
+    memmove(&row->chars[at+1], &row->chars[at], row->size - at + 1);
+    row->size++;
+    row->chars[at] = c;
+    editorUpdateRow(row);
+}
+
+// When backspacing take current line and copy it to the previous line
+void editorRowAppendString(erow *row, char *s, size_t len) {
+    editorRowUnshare(row);
+    row->chars = realloc(row->chars, row->size + len + 1);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+}
+
+void editorRowDelChar(erow *row, int at) {
+    if (at < 0 || at >= row->size) return;
+    editorRowUnshare(row);
+    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+    row->size--;
+    editorUpdateRow(row);
+}
+
+// Insert a string into a row at a given position
+void editorRowInsertString(erow *row, int at, char *s, size_t len) {
+    if (at < 0 || at > row->size) at = row->size;
+    editorRowUnshare(row);
+    row->chars = realloc(row->chars, row->size + len + 1);
+    memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+    memcpy(&row->chars[at], s, len);
+    row->size += len;
+    editorUpdateRow(row);
+}
+
+// Replace the text of a row with chars, which the row takes over
+void editorRowSetChars(erow *row, char *chars, int size) {
+    if (row->share) {
+        editorReleaseShare(row->share);
+        row->share = NULL;
+        row->render = NULL;
+    } else {
+        free(row->chars);
+    }
+    row->chars = chars;
+    row->size = size;
+    editorUpdateRow(row);
+}
+
+// Delete len bytes from a row starting at a given position
+void editorRowDelChars(erow *row, int at, int len) {
+    if (at < 0 || at >= row->size || len <= 0) return;
+    if (at + len > row->size) len = row->size - at;
+    editorRowUnshare(row);
+    memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+    row->size -= len;
+    editorUpdateRow(row);
+}
+
+
+//
+//
+/************* editor operations *************/
+//
+//
+
+void editorInsertChar(int c) {
+    // If cursor is on the tilde line after the end of the file, so append a new row to the file before isserting a character.
+    if (E.cy == E.numrows) {
+        editorInsertRow(E.numrows, "", 0);
+    }
+    editorRowInsertChar(&E.row[E.cy], E.cx, c);
+    E.cx++;
+}
+
+void editorInsertNewLine() {
+    if (E.cx == 0) {
+        editorInsertRow(E.cy, "", 0);
+    } else {
+        erow *row = &E.row[E.cy];
+        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+        row = &E.row[E.cy];
+        editorRowUnshare(row);
+        row->size = E.cx;
+        row->chars[row->size] = '\0';
+        editorUpdateRow(row);
+    }
+    E.cy++;
+    E.cx = 0;
+}
+
+void editorDelChar() {
+    if (E.cy == E.numrows) return;
+    // If cursor at begining of first line there is nothing to do
+    if (E.cx == 0 && E.cy == 0) return;
+
+    erow *row = &E.row[E.cy];
+    if (E.cx > 0) {
+        // Delete every byte of the character before the cursor
+        int n = 1;
+        while (E.cx - n > 0 && utf8IsContinuation(row->chars[E.cx - n])) n++;
+        E.cx -= n;
+        while (n--) editorRowDelChar(row, E.cx);
+    } else {
+        E.cx = E.row[E.cy - 1].size;
+        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+        editorDelRow(E.cy);
+        E.cy--;
+    }
+}
+
+
+//
+//
+/************* clipboard *************/
+//
+//
+
+// Fill in a clipboard row holding a copy of part of a line
+void editorClipRow(erow *row, char *s, int len) {
+    row->size = len;
+    row->chars = malloc(len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+    row->render = NULL;
+    row->share = NULL;
+    row->hl = NULL;
+    row->hl_state = HL_STATE_NORMAL;
+    editorRenderRow(row);
+}
+
+void editorClearClipboard() {
+    int j;
+    for (j = 0; j < clip.numrows; j++) editorFreeRow(&clip.rows[j]);
+    free(clip.rows);
+    clip.rows = NULL;
+    clip.numrows = 0;
+}
+
+// Get the selection in order, from (sx, sy) up to but not including (ex, ey). Returns 0 if nothing is selected.
+int editorSelectionBounds(int *sy, int *sx, int *ey, int *ex) {
+    if (!E.selecting || E.numrows == 0) return 0;
+    int ay = E.sely, ax = E.selx, by = E.cy, bx = E.cx;
+    if (ay > by || (ay == by && ax > bx)) {
+        ay = E.cy; ax = E.cx;
+        by = E.sely; bx = E.selx;
+    }
+    // The line after the end of the file stands for the end of the last row
+    if (by >= E.numrows) {
+        by = E.numrows - 1;
+        bx = E.row[by].size;
+    }
+    if (ay >= E.numrows) return 0;
+    // An anchor left behind by an edit that shortened its row is kept within the row
+    if (ax > E.row[ay].size) ax = E.row[ay].size;
+    if (bx > E.row[by].size) bx = E.row[by].size;
+    if (ay == by && ax >= bx) return 0;
+    *sy = ay; *sx = ax; *ey = by; *ex = bx;
+    return 1;
+}
+
+// Copy the selection. Whole rows in the middle of the selection share their text with the buffer instead of being copied; only partial first and last lines are copied.
+void editorCopy() {
+    int sy, sx, ey, ex;
+    if (!editorSelectionBounds(&sy, &sx, &ey, &ex)) {
+        editorSetStatusMessage("Nothing selected (Ctrl-K to start a selection)");
+        return;
+    }
+    editorClearClipboard();
+    int k = ey - sy;
+    clip.rows = malloc(sizeof(erow) * (k + 1));
+    clip.numrows = k + 1;
+
+    erow *first = &E.row[sy];
+    erow *last = &E.row[ey];
+    if (k == 0) {
+        if (sx == 0 && ex == first->size) editorShareRows(first, &clip.rows[0], 1);
+        else editorClipRow(&clip.rows[0], &first->chars[sx], ex - sx);
+    } else {
+        if (sx == 0) editorShareRows(first, &clip.rows[0], 1);
+        else editorClipRow(&clip.rows[0], &first->chars[sx], first->size - sx);
+        editorShareRows(&E.row[sy + 1], &clip.rows[1], k - 1);
+        if (ex == last->size) editorShareRows(last, &clip.rows[k], 1);
+        else editorClipRow(&clip.rows[k], last->chars, ex);
+    }
+    E.selecting = 0;
+    editorSetStatusMessage("Copied %d line%s", clip.numrows, clip.numrows == 1 ? "" : "s");
+}
+
+// Cut the selection. Whole rows are moved into the clipboard as they are, taken out of E.row with a single memmove.
+void editorCut() {
+    int sy, sx, ey, ex;
+    if (!editorSelectionBounds(&sy, &sx, &ey, &ex)) {
+        editorSetStatusMessage("Nothing selected (Ctrl-K to start a selection)");
+        return;
+    }
+    editorClearClipboard();
+    int k = ey - sy;
+    clip.rows = malloc(sizeof(erow) * (k + 1));
+    clip.numrows = k + 1;
+
+    if (k == 0) {
+        editorClipRow(&clip.rows[0], &E.row[sy].chars[sx], ex - sx);
+        editorRowDelChars(&E.row[sy], sx, ex - sx);
+    } else if (sx == 0) {
+        // The selection starts at the beginning of a line, so every row before the last one goes to the clipboard whole
+        editorDelRows(sy, k, clip.rows);
+        editorClipRow(&clip.rows[k], E.row[sy].chars, ex);
+        editorRowDelChars(&E.row[sy], 0, ex);
+    } else {
+        erow *first = &E.row[sy];
+        editorClipRow(&clip.rows[0], &first->chars[sx], first->size - sx);
+        editorDelRows(sy + 1, k - 1, &clip.rows[1]);
+        // The last line is now right after the first. Join the start of the first with the end of the last.
+        erow *last = &E.row[sy + 1];
+        editorClipRow(&clip.rows[k], last->chars, ex);
+        editorRowDelChars(&E.row[sy], sx, E.row[sy].size - sx);
+        editorRowAppendString(&E.row[sy], &last->chars[ex], last->size - ex);
+        editorDelRow(sy + 1);
+    }
+    E.cy = sy;
+    E.cx = sx;
+    E.selecting = 0;
+    editorSetStatusMessage("Cut %d line%s", clip.numrows, clip.numrows == 1 ? "" : "s");
+}
+
+// Splice n clipboard rows into the buffer at `at`, sharing their text
+void editorPasteRows(int at, int from, int n) {
+    if (n <= 0) return;
+    erow *rows = malloc(sizeof(erow) * n);
+    editorShareRows(&clip.rows[from], rows, n);
+    editorInsertRows(at, rows, n);
+    free(rows);
+}
+
+void editorPaste() {
+    if (clip.numrows == 0) {
+        editorSetStatusMessage("Clipboard is empty");
+        return;
+    }
+    E.selecting = 0;
+    int k = clip.numrows - 1;
+    erow *last = &clip.rows[k];
+
+    if (k >= 1 && E.cx == 0) {
+        // Pasting at the start of a line: every line but the last goes in whole, and the last is put in front of the current line
+        editorPasteRows(E.cy, 0, k);
+        if (last->size > 0) {
+            if (E.cy + k < E.numrows) editorRowInsertString(&E.row[E.cy + k], 0, last->chars, last->size);
+            else editorInsertRow(E.numrows, last->chars, last->size);
+        }
+    } else {
+        if (E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
+        erow *row = &E.row[E.cy];
+        if (k == 0) {
+            editorRowInsertString(row, E.cx, last->chars, last->size);
+            E.cx += last->size;
+            return;
+        }
+        // Split the current line around the cursor: the first pasted line goes after its start, and its end goes after the last pasted line
+        int taillen = row->size - E.cx;
+        char *joined = malloc(last->size + taillen + 1);
+        memcpy(joined, last->chars, last->size);
+        memcpy(&joined[last->size], &row->chars[E.cx], taillen);
+        editorRowDelChars(row, E.cx, taillen);
+        editorRowAppendString(row, clip.rows[0].chars, clip.rows[0].size);
+        editorPasteRows(E.cy + 1, 1, k - 1);
+        editorInsertRow(E.cy + k, joined, last->size + taillen);
+        free(joined);
+    }
+    E.cy += k;
+    E.cx = last->size;
+}
+
+//
+//
+/************* hex view *************/
+//
+//
+
+// A file is treated as binary if there's a NUL byte in its first block, which text files don't have
+int editorIsBinary(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) return 0;
+    char buf[8192];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    return n > 0 && memchr(buf, '\0', n) != NULL;
+}
+
+// Map E.filename for the hex view. Pages are only read in by the kernel when they're drawn, so a file of any size opens instantly.
+void editorHexOpen() {
+    int fd = open(E.filename, O_RDONLY);
+    if (fd == -1) die("open");
+    struct stat st;
+    if (fstat(fd, &st) == -1) die("fstat");
+    E.hex = 1;
+    E.mapsize = st.st_size;
+    E.map = NULL;
+    // A shared mapping sees what editorHexSave writes to the file, so the patches can be dropped once they're saved
+    if (E.mapsize > 0) {
+        E.map = mmap(NULL, E.mapsize, PROT_READ, MAP_SHARED, fd, 0);
+        if (E.map == MAP_FAILED) die("mmap");
+    }
+    close(fd);
+    E.dirty = 0;
+}
+
+// Index of the first patch at or after offset
+int editorHexFindPatch(long long offset) {
+    int lo = 0, hi = E.numpatches;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (E.patches[mid].offset < offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// The byte at offset as it will be saved
+unsigned char editorHexByte(long long offset) {
+    int p = editorHexFindPatch(offset);
+    if (p < E.numpatches && E.patches[p].offset == offset) return E.patches[p].byte;
+    return E.map[offset];
+}
+
+// Overwrite a byte. Putting back the byte that's in the file drops its patch, so the patch list is exactly what differs from the file and the buffer is dirty only while it isn't empty.
+void editorHexSetByte(long long offset, unsigned char byte) {
+    int p = editorHexFindPatch(offset);
+    int found = p < E.numpatches && E.patches[p].offset == offset;
+    if (byte == E.map[offset]) {
+        if (found) {
+            memmove(&E.patches[p], &E.patches[p + 1], sizeof(struct hexPatch) * (E.numpatches - p - 1));
+            E.numpatches--;
+        }
+    } else if (found) {
+        E.patches[p].byte = byte;
+    } else {
+        if (E.numpatches == E.patchcap) {
+            E.patchcap = E.patchcap ? E.patchcap * 2 : 64;
+            E.patches = realloc(E.patches, sizeof(struct hexPatch) * E.patchcap);
+        }
+        memmove(&E.patches[p + 1], &E.patches[p], sizeof(struct hexPatch) * (E.numpatches - p));
+        E.patches[p].offset = offset;
+        E.patches[p].byte = byte;
+        E.numpatches++;
+    }
+    E.dirty = E.numpatches > 0;
+}
+
+// Number of hex digits in the offset column, enough for the last offset in the file
+int editorHexOffsetWidth() {
+    int width = 8;
+    while (width < 16 && (E.mapsize - 1) >> (width * 4) > 0) width++;
+    return width;
+}
+
+// Bytes shown on each row: as many as fit, from KILO_HEX_ROW_BYTES down by halves. A row is the offset, two spaces, "xx " for every byte, a space and the ASCII column.
+int editorHexRowBytes() {
+    int n = KILO_HEX_ROW_BYTES;
+    while (n > 1 && editorHexOffsetWidth() + 3 + n * 4 > E.screencols) n /= 2;
+    return n;
+}
+
+// Write the patches back into the file in place. Runs of neighbouring bytes go out with a single pwrite, and nothing else in the file is touched.
+void editorHexSave() {
+    if (E.numpatches == 0) {
+        editorSetStatusMessage("No changes to save");
+        return;
+    }
+    int fd = open(E.filename, O_WRONLY);
+    if (fd == -1) {
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+        return;
+    }
+    unsigned char buf[4096];
+    long long written = 0;
+    int p = 0;
+    while (p < E.numpatches) {
+        long long start = E.patches[p].offset;
+        int n = 0;
+        while (p < E.numpatches && n < (int)sizeof(buf) && E.patches[p].offset == start + n)
+            buf[n++] = E.patches[p++].byte;
+        if (pwrite(fd, buf, n, start) != n) {
+            close(fd);
+            editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+            return;
+        }
+        written += n;
+    }
+    close(fd);
+    free(E.patches);
+    E.patches = NULL;
+    E.numpatches = 0;
+    E.patchcap = 0;
+    E.dirty = 0;
+    editorSetStatusMessage("%lld bytes written to disk", written);
+}
+
+//
+//
+/************* file i/o *************/
+//
+//
+
+// Function that converts our array of erow structs into a single string that is ready to be written to a file
+char *editorRowsToString(int *buflen) {
+    int totlen = 0;
+    int j;
+    for (j = 0; j < E.numrows; j++)
+        totlen += E.row[j].size + 1;
+    *buflen = totlen;
+
+    char *buf = malloc(totlen);
+    char *p = buf;
+    for (j = 0; j < E.numrows; j++) {
+        memcpy(p, E.row[j].chars, E.row[j].size);
+        p += E.row[j].size;
+        *p = '\n';
+        p++;
+    }
+    return buf;
 }
 
 
@@ -446,6 +2154,13 @@ void editorOpen(char *filename) {
     // strdup() makes copy of the given string, allocating the required memory and assuming you will free() that memory. We initialize E.filename to NULL pointer and it will stay NULL if a file isn't opened.
     E.filename = strdup(filename);
 
+    if (force_hex || editorIsBinary(filename)) {
+        editorHexOpen();
+        return;
+    }
+
+    editorSelectSyntaxHighlight();
+
     FILE *fp = fopen(filename, "r");
     if (!fp) die("fopen");
 
@@ -463,11 +2178,15 @@ void editorOpen(char *filename) {
     }
     free(line);
     fclose(fp);
-    E.dirty = 0;
+    editorMarkSaved();
 }
 
 
 void editorSave() {
+    if (E.hex) {
+        editorHexSave();
+        return;
+    }
     // If it's a new file then E.filename will be NULL and won't know where to save (will fix later)
     if (E.filename == NULL) {
         E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
@@ -475,6 +2194,11 @@ void editorSave() {
             editorSetStatusMessage("Save aborted");
             return;
         }
+        editorSelectSyntaxHighlight();
+    } else if (!E.dirty) {
+        // Nothing differs from the file, so there's nothing to write
+        editorSetStatusMessage("No changes to save");
+        return;
     }
 
     int len;
@@ -488,7 +2212,7 @@ void editorSave() {
             if (write(fd, buf, len) == len) {
                 close(fd);
                 free(buf);
-                E.dirty = 0;
+                editorMarkSaved();
                 editorSetStatusMessage("%d bytes written to disk", len);
                 return;
             }
@@ -501,6 +2225,129 @@ void editorSave() {
 
 
 
+//
+//
+/************* buffers *************/
+//
+//
+
+// Reset E to an empty buffer. The terminal and message bar fields are left alone.
+void initBuffer() {
+    E.cx = 0;
+    E.cy = 0;
+    E.rx = 0;
+    // Keep track of scroller to view lines. Default to 0 so scrolled to top by default
+    E.rowoff = 0;
+    E.coloff = 0;
+    E.wrap = 0;
+    E.vrowoff = 0;
+    E.vrowsub = 0;
+    indexInit(&E.wrapidx, editorWrapWeight);
+    indexInit(&E.byteidx, editorByteWeight);
+    // For now editor will only display a single line of text, and so numrows can be either 0 or 1
+    E.numrows = 0;
+    E.row = NULL;
+    E.dirty = 0;
+    E.hash = editorLinkHashes(0, 0);
+    E.savedhash = E.hash;
+    E.savedorder = editorOrderHash();
+    E.filename = NULL;
+    E.syntax = NULL;
+    E.hlrows = 0;
+    E.selecting = 0;
+    E.selx = 0;
+    E.sely = 0;
+    E.hex = 0;
+    E.map = NULL;
+    E.mapsize = 0;
+    E.hexcx = 0;
+    E.hexnibble = 0;
+    E.hexoff = 0;
+    E.patches = NULL;
+    E.numpatches = 0;
+    E.patchcap = 0;
+    E.diffof = -1;
+    E.cursors = NULL;
+    E.numcursors = 0;
+    E.cursorcap = 0;
+    E.undo = NULL;
+    E.numundo = 0;
+    E.folds = NULL;
+    E.numfolds = 0;
+    E.foldcap = 0;
+}
+
+// Make buffer n the active one. The whole buffer is swapped in, with its rows, render and highlight caches, indexes and cursor, so nothing is read or rebuilt.
+void editorSwitchBuffer(int n) {
+    if (n == curbuffer || n < 0 || n >= numbuffers) return;
+    buffers[curbuffer] = E;
+    struct editorConfig next = buffers[n];
+
+    // The screen and message bar belong to the terminal, not to a buffer
+    next.screenrows = E.screenrows;
+    next.screencols = E.screencols;
+    memcpy(next.statusmsg, E.statusmsg, sizeof(E.statusmsg));
+    next.statusmsg_time = E.statusmsg_time;
+    next.orig_termios = E.orig_termios;
+
+    E = next;
+    curbuffer = n;
+}
+
+// Add an empty buffer after the others and make it active
+void editorNewBuffer() {
+    buffers = realloc(buffers, sizeof(struct editorConfig) * (numbuffers + 1));
+    buffers[curbuffer] = E;
+    curbuffer = numbuffers++;
+    int wrap = E.wrap;
+    initBuffer();
+    E.wrap = wrap;
+}
+
+// Ctrl-O: switch to the buffer for a file, opening it into a new buffer if it isn't open yet
+void editorOpenBuffer() {
+    char *filename = editorPrompt("Open: %s (ESC to cancel)", NULL);
+    if (filename == NULL) return;
+
+    int j;
+    for (j = 0; j < numbuffers; j++) {
+        char *name = j == curbuffer ? E.filename : buffers[j].filename;
+        if (name && strcmp(name, filename) == 0) {
+            editorSwitchBuffer(j);
+            free(filename);
+            return;
+        }
+    }
+
+    if (access(filename, R_OK) == -1) {
+        editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+        free(filename);
+        return;
+    }
+    editorNewBuffer();
+    editorOpen(filename);
+    free(filename);
+}
+
+// Ctrl-B: cycle through the open buffers
+void editorNextBuffer() {
+    if (numbuffers < 2) {
+        editorSetStatusMessage("Only one buffer open");
+        return;
+    }
+    editorSwitchBuffer((curbuffer + 1) % numbuffers);
+    editorSetStatusMessage("[%d/%d] %s", curbuffer + 1, numbuffers, E.filename ? E.filename : "[No Name]");
+}
+
+// Whether any open buffer has unsaved changes
+int editorAnyDirty() {
+    int j;
+    if (E.dirty) return 1;
+    for (j = 0; j < numbuffers; j++)
+        if (j != curbuffer && buffers[j].dirty) return 1;
+    return 0;
+}
+
 //
 //
 /************* find *************/
@@ -539,30 +2386,714 @@ void editorFindCallback(char *query, int key) {
         if (match) {
             last_match = current;
             E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
+            E.cx = editorRowRxToCx(row, editorRenderByteToCol(row, match - row->render));
             E.rowoff = E.numrows;
             break;
         }
     }
-}
+}
+
+
+void editorFind() {
+    int saved_cx = E.cx;
+    int saved_cy = E.cy;
+    int saved_coloff = E.coloff;
+    int saved_rowoff = E.rowoff;
+
+    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+
+    if (query) {
+        free(query);
+    } else {
+        E.cx = saved_cx;
+        E.cy = saved_cy;
+        E.coloff = saved_coloff;
+        E.rowoff = saved_rowoff;
+    }
+}
+
+//
+//
+/************* multiple cursors *************/
+//
+//
+
+enum multiEdit {
+    MULTI_INSERT,
+    MULTI_BACKSPACE,
+    MULTI_DELETE
+};
+
+int cursorCompare(const void *a, const void *b) {
+    const struct editorCursor *x = a, *y = b;
+    if (x->cy != y->cy) return x->cy < y->cy ? -1 : 1;
+    if (x->cx != y->cx) return x->cx < y->cx ? -1 : 1;
+    return 0;
+}
+
+// Sort the extra cursors and drop the ones that have run into each other or into the main cursor
+void editorSortCursors() {
+    qsort(E.cursors, E.numcursors, sizeof(struct editorCursor), cursorCompare);
+    int j, k = 0;
+    for (j = 0; j < E.numcursors; j++) {
+        struct editorCursor *c = &E.cursors[j];
+        if (c->cx == E.cx && c->cy == E.cy) continue;
+        if (k > 0 && cursorCompare(c, &E.cursors[k - 1]) == 0) continue;
+        E.cursors[k++] = *c;
+    }
+    E.numcursors = k;
+}
+
+// Add a cursor. Call editorSortCursors once done adding.
+void editorAddCursor(int cx, int cy) {
+    if (E.numcursors == E.cursorcap) {
+        E.cursorcap = E.cursorcap ? E.cursorcap * 2 : 16;
+        E.cursors = realloc(E.cursors, sizeof(struct editorCursor) * E.cursorcap);
+    }
+    E.cursors[E.numcursors].cx = cx;
+    E.cursors[E.numcursors].cy = cy;
+    E.numcursors++;
+}
+
+void editorClearCursors() {
+    E.numcursors = 0;
+}
+
+// Index of the first extra cursor on row cy or after it
+int editorFirstCursor(int cy) {
+    int lo = 0, hi = E.numcursors;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (E.cursors[mid].cy < cy) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Ctrl-N: add a cursor on the line below the last one, at the main cursor's column. With a selection, put a cursor at that column on every line of the selection that's long enough instead.
+void editorAddCursors() {
+    if (E.cy >= E.numrows) return;
+    int rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    if (E.selecting) {
+        int from = E.sely < E.cy ? E.sely : E.cy;
+        int to = E.sely < E.cy ? E.cy : E.sely;
+        int j;
+        for (j = from; j <= to && j < E.numrows; j++)
+            if (j != E.cy && !editorRowHidden(j) && E.row[j].rcols >= rx) editorAddCursor(editorRowRxToCx(&E.row[j], rx), j);
+        E.selecting = 0;
+    } else {
+        int cy = E.cy;
+        if (E.numcursors > 0 && E.cursors[E.numcursors - 1].cy > cy) cy = E.cursors[E.numcursors - 1].cy;
+        cy = editorNextVisibleRow(cy);
+        if (cy >= E.numrows) {
+            editorSetStatusMessage("No more lines to add a cursor on");
+            return;
+        }
+        editorAddCursor(editorRowRxToCx(&E.row[cy], rx), cy);
+    }
+    editorSortCursors();
+    editorSetStatusMessage("%d cursors", E.numcursors + 1);
+}
+
+// Ctrl-A: put a cursor at the start of every match of a string. The main cursor goes to the first one.
+void editorAddCursorsAtMatches() {
+    char *query = editorPrompt("Add cursors at: %s (ESC to cancel)", NULL);
+    if (query == NULL) return;
+    int qlen = strlen(query);
+    int found = 0;
+    int j;
+    for (j = 0; j < E.numrows; j++) {
+        char *p = E.row[j].chars;
+        while ((p = strstr(p, query)) != NULL) {
+            int at = p - E.row[j].chars;
+            if (found++ == 0) {
+                E.cx = at;
+                E.cy = j;
+            } else {
+                editorAddCursor(at, j);
+            }
+            p += qlen;
+        }
+    }
+    if (found) {
+        E.selecting = 0;
+        editorSortCursors();
+        editorSetStatusMessage("%d cursors", E.numcursors + 1);
+    } else {
+        editorSetStatusMessage("No matches for %s", query);
+    }
+    free(query);
+}
+
+void editorFreeUndo(struct undoRecord *u) {
+    int j;
+    for (j = 0; j < u->numrows; j++) free(u->rows[j].chars);
+    free(u->rows);
+    free(u->cursors);
+}
+
+// Apply an edit at every cursor at once. Each row with cursors on it is rebuilt a single time with all of its edits, and is saved first so Ctrl-Z can undo the whole edit.
+// Backspace and delete stay within their row.
+void editorMultiEdit(int op, char *s, int len) {
+    int n = E.numcursors + 1;
+    struct editorCursor *all = malloc(sizeof(struct editorCursor) * n);
+    memcpy(all, E.cursors, sizeof(struct editorCursor) * E.numcursors);
+    all[n - 1].cx = E.cx;
+    all[n - 1].cy = E.cy;
+    qsort(all, n, sizeof(struct editorCursor), cursorCompare);
+    int mainidx = 0;
+    while (all[mainidx].cx != E.cx || all[mainidx].cy != E.cy) mainidx++;
+
+    struct undoRecord u;
+    u.rows = malloc(sizeof(struct undoRow) * n);
+    u.numrows = 0;
+    u.cursors = malloc(sizeof(struct editorCursor) * (E.numcursors + 1));
+    memcpy(u.cursors, E.cursors, sizeof(struct editorCursor) * E.numcursors);
+    u.numcursors = E.numcursors;
+    u.cx = E.cx;
+    u.cy = E.cy;
+
+    int i = 0;
+    while (i < n) {
+        int cy = all[i].cy;
+        int k = i;
+        while (k < n && all[k].cy == cy) k++;
+        if (cy >= E.numrows) {
+            i = k;
+            continue;
+        }
+        erow *row = &E.row[cy];
+        struct undoRow *ur = &u.rows[u.numrows++];
+        ur->at = cy;
+        ur->size = row->size;
+        ur->chars = malloc(row->size + 1);
+        memcpy(ur->chars, row->chars, row->size + 1);
+
+        // Copy the row across, leaving out or putting in text at every cursor on it
+        char *out = malloc(row->size + (k - i) * len + 1);
+        int olen = 0, prev = 0, j;
+        for (j = i; j < k; j++) {
+            int at = all[j].cx;
+            int cut = at, next = at;
+            if (op == MULTI_BACKSPACE && at > prev) {
+                do cut--; while (cut > prev && utf8IsContinuation(row->chars[cut]));
+            }
+            if (op == MULTI_DELETE && at < row->size) {
+                do next++; while (next < row->size && utf8IsContinuation(row->chars[next]));
+            }
+            memcpy(&out[olen], &row->chars[prev], cut - prev);
+            olen += cut - prev;
+            if (op == MULTI_INSERT) {
+                memcpy(&out[olen], s, len);
+                olen += len;
+            }
+            all[j].cx = olen;
+            prev = next;
+        }
+        memcpy(&out[olen], &row->chars[prev], row->size - prev);
+        olen += row->size - prev;
+        out[olen] = '\0';
+        editorRowSetChars(row, out, olen);
+        i = k;
+    }
+
+    E.cx = all[mainidx].cx;
+    E.cy = all[mainidx].cy;
+    int j, k = 0;
+    for (j = 0; j < n; j++)
+        if (j != mainidx) E.cursors[k++] = all[j];
+    E.numcursors = k;
+    editorSortCursors();
+    free(all);
+
+    if (u.numrows == 0) {
+        editorFreeUndo(&u);
+        return;
+    }
+    u.hash = E.hash;
+    if (E.numundo == KILO_UNDO_LEVELS) {
+        editorFreeUndo(&E.undo[0]);
+        memmove(&E.undo[0], &E.undo[1], sizeof(struct undoRecord) * (E.numundo - 1));
+        E.numundo--;
+    }
+    E.undo = realloc(E.undo, sizeof(struct undoRecord) * (E.numundo + 1));
+    E.undo[E.numundo++] = u;
+}
+
+// Move a cursor along its row, without going on to the next or previous row
+void editorMoveAlongRow(int *cx, int cy, int key) {
+    if (cy >= E.numrows) return;
+    erow *row = &E.row[cy];
+    if (key == ARROW_LEFT && *cx > 0) {
+        do (*cx)--; while (*cx > 0 && utf8IsContinuation(row->chars[*cx]));
+    } else if (key == ARROW_RIGHT && *cx < row->size) {
+        do (*cx)++; while (*cx < row->size && utf8IsContinuation(row->chars[*cx]));
+    } else if (key == HOME_KEY) {
+        *cx = 0;
+    } else if (key == END_KEY) {
+        *cx = row->size;
+    }
+}
+
+void editorMultiMove(int key) {
+    int j;
+    editorMoveAlongRow(&E.cx, E.cy, key);
+    for (j = 0; j < E.numcursors; j++) editorMoveAlongRow(&E.cursors[j].cx, E.cursors[j].cy, key);
+    editorSortCursors();
+}
+
+// Ctrl-Z: undo the last multi-cursor edit, putting back the rows it changed and the cursors
+void editorUndo() {
+    if (E.numundo == 0) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    struct undoRecord *u = &E.undo[E.numundo - 1];
+    if (u->hash != E.hash) {
+        // The buffer was edited some other way since, and the saved rows may no longer fit
+        int j;
+        for (j = 0; j < E.numundo; j++) editorFreeUndo(&E.undo[j]);
+        E.numundo = 0;
+        editorSetStatusMessage("Can't undo: the buffer was changed since");
+        return;
+    }
+    int j;
+    for (j = 0; j < u->numrows; j++)
+        editorRowSetChars(&E.row[u->rows[j].at], u->rows[j].chars, u->rows[j].size);
+    free(u->rows);
+    free(E.cursors);
+    E.cursors = u->cursors;
+    E.numcursors = u->numcursors;
+    E.cursorcap = u->numcursors + 1;
+    E.cx = u->cx;
+    E.cy = u->cy;
+    // The rows changed under any selection
+    E.selecting = 0;
+    E.numundo--;
+    editorSetStatusMessage("Undone at %d cursor%s", E.numcursors + 1, E.numcursors ? "s" : "");
+}
+
+//
+//
+/************* goto *************/
+//
+//
+
+// Byte offset of the cursor in the file as it would be saved
+long long editorCursorOffset() {
+    if (E.hex) return E.hexcx;
+    return indexPrefix(&E.byteidx, E.cy) + E.cx;
+}
+
+// Jump to a line number, or to a byte offset when the input starts with '@'. Offsets can be given in hex with 0x.
+void editorGoto() {
+    char *query = editorPrompt("Go to line, or @offset: %s (ESC to cancel)", NULL);
+    if (query == NULL) return;
+
+    int is_offset = query[0] == '@';
+    char *end;
+    errno = 0;
+    // Numbers are decimal even with leading zeros, as offsets copied from dumps often have. Only an offset written with 0x is hex.
+    char *num = query + is_offset;
+    int hex = is_offset && num[0] == '0' && (num[1] == 'x' || num[1] == 'X');
+    long long n = strtoll(hex ? num + 2 : num, &end, hex ? 16 : 10);
+    if (errno || end == num + 2 * hex || *end != '\0' || n < 0 || !isxdigit((unsigned char)num[2 * hex])) {
+        editorSetStatusMessage("Not a %s: %s", is_offset ? "byte offset" : "line number", query);
+        free(query);
+        return;
+    }
+    free(query);
+
+    if (E.hex) {
+        // Line numbers count rows of the dump
+        int bpr = editorHexRowBytes();
+        long long off = n;
+        if (!is_offset) off = n < 1 ? 0 : n - 1 > E.mapsize / bpr ? E.mapsize : (n - 1) * bpr;
+        if (off >= E.mapsize) off = E.mapsize > 0 ? E.mapsize - 1 : 0;
+        E.hexcx = off;
+        E.hexnibble = 0;
+        E.hexoff = off - off % bpr;
+        return;
+    }
+
+    if (is_offset) {
+        // The remainder is how far into the row the offset is. An offset pointing at the newline puts the cursor at the end of the row.
+        long long rem;
+        E.cy = indexFind(&E.byteidx, n, &rem);
+        E.cx = E.cy < E.numrows ? rem : 0;
+    } else {
+        if (n < 1) n = 1;
+        E.cy = n > E.numrows ? E.numrows : n - 1;
+        E.cx = 0;
+    }
+    // Scroll so the target is at the top of the screen
+    E.rowoff = E.numrows;
+}
+
+//
+//
+/************* diff *************/
+//
+//
+
+// State of a diff between the file on disk (a) and the buffer (b). Lines are compared by their hashes only.
+struct diffState {
+    // Lines of the file: its mapping, where every line starts, and their hashes
+    char *map;
+    long long *lineoff;
+    unsigned long long *ahash;
+    int alen;
+    // Lines of both sides that are left to be matched up, as hashes and as line numbers
+    unsigned long long *a, *b;
+    int *aline, *bline;
+    // Lines that aren't part of the common subsequence
+    char *deleted, *inserted;
+    // Furthest x reached on every diagonal, searching forward and backward
+    int *vf, *vb;
+    // The diff as rows of the diff buffer
+    erow *out;
+    int numout;
+    int outcap;
+};
+
+// Find where the shortest edit path through a[alo..ahi) and b[blo..bhi) crosses the middle, the linear space refinement of Myers' O(ND) diff. The path is searched for from both corners at once, and the run of matching lines where the two searches meet is returned as (sx, sy) to (ex, ey).
+// Returns 0 if the two ends are more than KILO_DIFF_MAX_COST edits apart.
+int diffMiddleSnake(struct diffState *d, int alo, int ahi, int blo, int bhi, int *sx, int *sy, int *ex, int *ey) {
+    int n = ahi - alo, m = bhi - blo;
+    int delta = n - m;
+    int odd = delta & 1;
+    int maxd = (n + m + 1) / 2;
+    if (maxd > KILO_DIFF_MAX_COST) maxd = KILO_DIFF_MAX_COST;
+    // Diagonal k is x - y, and is indexed from the middle of the arrays. The backward search counts x and k from the bottom right corner.
+    int *vf = d->vf + KILO_DIFF_MAX_COST + 1;
+    int *vb = d->vb + KILO_DIFF_MAX_COST + 1;
+    vf[1] = 0;
+    vb[1] = 0;
+    int D, k;
+    for (D = 0; D <= maxd; D++) {
+        for (k = -D; k <= D; k += 2) {
+            int x = (k == -D || (k != D && vf[k - 1] < vf[k + 1])) ? vf[k + 1] : vf[k - 1] + 1;
+            int y = x - k;
+            int x0 = x, y0 = y;
+            while (x < n && y < m && d->a[alo + x] == d->b[blo + y]) {
+                x++;
+                y++;
+            }
+            vf[k] = x;
+            int c = delta - k;
+            if (odd && c >= -(D - 1) && c <= D - 1 && vf[k] + vb[c] >= n) {
+                *sx = alo + x0; *sy = blo + y0;
+                *ex = alo + x; *ey = blo + y;
+                return 1;
+            }
+        }
+        for (k = -D; k <= D; k += 2) {
+            int x = (k == -D || (k != D && vb[k - 1] < vb[k + 1])) ? vb[k + 1] : vb[k - 1] + 1;
+            int y = x - k;
+            int x0 = x, y0 = y;
+            while (x < n && y < m && d->a[ahi - x - 1] == d->b[bhi - y - 1]) {
+                x++;
+                y++;
+            }
+            vb[k] = x;
+            int c = delta - k;
+            if (!odd && c >= -D && c <= D && vb[k] + vf[c] >= n) {
+                *sx = ahi - x; *sy = bhi - y;
+                *ex = ahi - x0; *ey = bhi - y0;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Mark the lines of a[alo..ahi) and b[blo..bhi) that aren't in their longest common subsequence, splitting the problem at the middle snake until one side is empty
+void diffCompare(struct diffState *d, int alo, int ahi, int blo, int bhi) {
+    while (alo < ahi && blo < bhi && d->a[alo] == d->b[blo]) {
+        alo++;
+        blo++;
+    }
+    while (alo < ahi && blo < bhi && d->a[ahi - 1] == d->b[bhi - 1]) {
+        ahi--;
+        bhi--;
+    }
+    int sx, sy, ex, ey;
+    if (alo < ahi && blo < bhi && diffMiddleSnake(d, alo, ahi, blo, bhi, &sx, &sy, &ex, &ey)) {
+        diffCompare(d, alo, sx, blo, sy);
+        diffCompare(d, ex, ahi, ey, bhi);
+        return;
+    }
+    // One side is empty, or the sides are too different to be worth matching up
+    for (; alo < ahi; alo++) d->deleted[d->aline[alo]] = 1;
+    for (; blo < bhi; blo++) d->inserted[d->bline[blo]] = 1;
+}
+
+// Hash set of lines, by open addressing. Slots hold hash | 1 so that 0 can mean empty.
+unsigned long long *diffSetBuild(unsigned long long *hashes, int n, unsigned int *mask) {
+    unsigned int size = 16;
+    while (size < (unsigned int)n * 2) size *= 2;
+    unsigned long long *set = calloc(size, sizeof(unsigned long long));
+    int j;
+    for (j = 0; j < n; j++) {
+        unsigned int i = hashes[j] & (size - 1);
+        while (set[i] && set[i] != (hashes[j] | 1)) i = (i + 1) & (size - 1);
+        set[i] = hashes[j] | 1;
+    }
+    *mask = size - 1;
+    return set;
+}
+
+int diffSetHas(unsigned long long *set, unsigned int mask, unsigned long long h) {
+    unsigned int i = h & mask;
+    while (set[i]) {
+        if (set[i] == (h | 1)) return 1;
+        i = (i + 1) & mask;
+    }
+    return 0;
+}
+
+// Keep the lines of one side that also appear somewhere on the other. A line that's only on one side can't be matched, so it's marked changed right away and the O(ND) search never sees it. This is what keeps diffs of unrelated files or rewritten blocks fast.
+int diffKeepShared(unsigned long long *hashes, int *lines, int n, unsigned long long *other, int on, char *changed) {
+    unsigned int mask;
+    unsigned long long *set = diffSetBuild(other, on, &mask);
+    int j, kept = 0;
+    for (j = 0; j < n; j++) {
+        if (diffSetHas(set, mask, hashes[j])) {
+            hashes[kept] = hashes[j];
+            lines[kept++] = lines[j];
+        } else {
+            changed[lines[j]] = 1;
+        }
+    }
+    free(set);
+    return kept;
+}
+
+// Add a row to the diff output made of a prefix and the text of a line
+void diffAddRow(struct diffState *d, const char *prefix, const char *s, int len) {
+    if (d->numout == d->outcap) {
+        d->outcap = d->outcap ? d->outcap * 2 : 64;
+        d->out = realloc(d->out, sizeof(erow) * d->outcap);
+    }
+    int plen = strlen(prefix);
+    erow *row = &d->out[d->numout++];
+    row->size = plen + len;
+    row->chars = malloc(row->size + 1);
+    memcpy(row->chars, prefix, plen);
+    memcpy(&row->chars[plen], s, len);
+    row->chars[row->size] = '\0';
+    row->render = NULL;
+    row->share = NULL;
+    row->hl = NULL;
+    row->hl_state = HL_STATE_NORMAL;
+    editorRenderRow(row);
+}
+
+// Text of line i of the file, without its line ending, the same way editorOpen reads it
+char *diffFileLine(struct diffState *d, int i, int *len) {
+    long long start = d->lineoff[i];
+    long long end = d->lineoff[i + 1];
+    while (end > start && (d->map[end - 1] == '\n' || d->map[end - 1] == '\r')) end--;
+    *len = end - start;
+    return &d->map[start];
+}
+
+// Write the changes out as unified diff hunks with KILO_DIFF_CONTEXT lines of context. Hunks closer together than twice that are joined.
+int diffHunks(struct diffState *d, int *added, int *removed) {
+    int n = d->alen, m = E.numrows;
+    int i = 0, j = 0, prev = 0, hunks = 0;
+    *added = *removed = 0;
+    while (1) {
+        while (i < n && j < m && !d->deleted[i] && !d->inserted[j]) {
+            i++;
+            j++;
+        }
+        if (i >= n && j >= m) break;
+
+        int ctx = i - prev < KILO_DIFF_CONTEXT ? i - prev : KILO_DIFF_CONTEXT;
+        int hi = i - ctx, hj = j - ctx;
+        while (1) {
+            while (i < n && d->deleted[i]) i++;
+            while (j < m && d->inserted[j]) j++;
+            int run = 0;
+            while (i + run < n && j + run < m && !d->deleted[i + run] && !d->inserted[j + run]) run++;
+            if (i + run >= n && j + run >= m) {
+                if (run > KILO_DIFF_CONTEXT) run = KILO_DIFF_CONTEXT;
+                i += run;
+                j += run;
+                break;
+            }
+            if (run > 2 * KILO_DIFF_CONTEXT) {
+                i += KILO_DIFF_CONTEXT;
+                j += KILO_DIFF_CONTEXT;
+                break;
+            }
+            i += run;
+            j += run;
+        }
+
+        // An empty range is numbered after the line it follows
+        char header[64];
+        snprintf(header, sizeof(header), "@@ -%d,%d +%d,%d @@", i - hi ? hi + 1 : hi, i - hi, j - hj ? hj + 1 : hj, j - hj);
+        diffAddRow(d, header, "", 0);
+        int a = hi, b = hj, len;
+        while (a < i || b < j) {
+            if (a < i && d->deleted[a]) {
+                char *s = diffFileLine(d, a++, &len);
+                diffAddRow(d, "-", s, len);
+                (*removed)++;
+            } else if (b < j && d->inserted[b]) {
+                diffAddRow(d, "+", E.row[b].chars, E.row[b].size);
+                b++;
+                (*added)++;
+            } else {
+                diffAddRow(d, " ", E.row[b].chars, E.row[b].size);
+                a++;
+                b++;
+            }
+        }
+        hunks++;
+        prev = i;
+    }
+    return hunks;
+}
+
+// Ctrl-D: show what changed between the file on disk and the buffer in a diff buffer, or go back from the diff buffer to the file.
+// Matching lines at the start and end are skipped by comparing row hashes before anything else is done, so a few edits in a huge file only cost reading the file once.
+void editorDiff() {
+    if (E.diffof >= 0) {
+        editorSwitchBuffer(E.diffof);
+        return;
+    }
+    if (E.filename == NULL) {
+        editorSetStatusMessage("No file to compare with");
+        return;
+    }
+    int fd = open(E.filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        editorSetStatusMessage("Can't read %s: %s", E.filename, strerror(errno));
+        if (fd != -1) close(fd);
+        return;
+    }
 
+    struct diffState d;
+    memset(&d, 0, sizeof(d));
+    if (st.st_size > 0) {
+        d.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (d.map == MAP_FAILED) {
+            editorSetStatusMessage("Can't read %s: %s", E.filename, strerror(errno));
+            close(fd);
+            return;
+        }
+    }
+    close(fd);
+
+    // Split the file into lines the way getline does, and hash them
+    int cap = 1024;
+    d.lineoff = malloc(sizeof(long long) * cap);
+    long long off = 0;
+    while (off < st.st_size) {
+        if (d.alen + 2 > cap) {
+            cap *= 2;
+            d.lineoff = realloc(d.lineoff, sizeof(long long) * cap);
+        }
+        d.lineoff[d.alen++] = off;
+        char *nl = memchr(&d.map[off], '\n', st.st_size - off);
+        off = nl ? nl - d.map + 1 : st.st_size;
+    }
+    d.lineoff[d.alen] = st.st_size;
+    d.ahash = malloc(sizeof(unsigned long long) * (d.alen + 1));
+    int i, len;
+    for (i = 0; i < d.alen; i++) {
+        char *s = diffFileLine(&d, i, &len);
+        d.ahash[i] = hashBytes(s, len);
+    }
 
-void editorFind() {
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
+    int n = d.alen, m = E.numrows;
+    int lo = 0, ahi = n, bhi = m;
+    while (lo < ahi && lo < bhi && d.ahash[lo] == E.row[lo].hash) lo++;
+    while (ahi > lo && bhi > lo && d.ahash[ahi - 1] == E.row[bhi - 1].hash) {
+        ahi--;
+        bhi--;
+    }
 
-    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+    d.deleted = calloc(n + 1, 1);
+    d.inserted = calloc(m + 1, 1);
+    d.a = malloc(sizeof(unsigned long long) * (ahi - lo + 1));
+    d.b = malloc(sizeof(unsigned long long) * (bhi - lo + 1));
+    d.aline = malloc(sizeof(int) * (ahi - lo + 1));
+    d.bline = malloc(sizeof(int) * (bhi - lo + 1));
+    for (i = lo; i < ahi; i++) {
+        d.a[i - lo] = d.ahash[i];
+        d.aline[i - lo] = i;
+    }
+    for (i = lo; i < bhi; i++) {
+        d.b[i - lo] = E.row[i].hash;
+        d.bline[i - lo] = i;
+    }
+    int an = ahi - lo, bn = bhi - lo;
+    // Both sets are built from the full middle part before either side is thinned out
+    unsigned long long *afull = malloc(sizeof(unsigned long long) * (an + 1));
+    memcpy(afull, d.a, sizeof(unsigned long long) * an);
+    an = diffKeepShared(d.a, d.aline, an, d.b, bn, d.deleted);
+    bn = diffKeepShared(d.b, d.bline, bn, afull, ahi - lo, d.inserted);
+    free(afull);
+
+    d.vf = malloc(sizeof(int) * (2 * KILO_DIFF_MAX_COST + 4));
+    d.vb = malloc(sizeof(int) * (2 * KILO_DIFF_MAX_COST + 4));
+    diffCompare(&d, 0, an, 0, bn);
+
+    int added, removed;
+    char header[128];
+    snprintf(header, sizeof(header), "--- %s", E.filename);
+    diffAddRow(&d, header, "", 0);
+    snprintf(header, sizeof(header), "+++ %s", E.filename);
+    diffAddRow(&d, header, "", 0);
+    int hunks = diffHunks(&d, &added, &removed);
+
+    if (d.map) munmap(d.map, st.st_size);
+    free(d.lineoff);
+    free(d.ahash);
+    free(d.a);
+    free(d.b);
+    free(d.aline);
+    free(d.bline);
+    free(d.deleted);
+    free(d.inserted);
+    free(d.vf);
+    free(d.vb);
+
+    if (hunks == 0) {
+        for (i = 0; i < d.numout; i++) editorFreeRow(&d.out[i]);
+        free(d.out);
+        editorSetStatusMessage("No changes from %s on disk", E.filename);
+        return;
+    }
 
-    if (query) {
-        free(query);
+    // Reuse the diff buffer of this buffer if there is one, so Ctrl-D goes back and forth between the two
+    int src = curbuffer;
+    int j;
+    for (j = 0; j < numbuffers; j++)
+        if (j != curbuffer && buffers[j].diffof == src) break;
+    if (j < numbuffers) {
+        editorSwitchBuffer(j);
+        editorDelRows(0, E.numrows, NULL);
     } else {
-        E.cx = saved_cx;
-        E.cy = saved_cy;
-        E.coloff = saved_coloff;
-        E.rowoff = saved_rowoff;
+        editorNewBuffer();
+        E.diffof = src;
+        unsigned int h;
+        for (h = 0; h < HLDB_ENTRIES; h++)
+            if (!strcmp(HLDB[h].filetype, "diff")) E.syntax = &HLDB[h];
     }
+    editorInsertRows(0, d.out, d.numout);
+    free(d.out);
+    editorMarkSaved();
+    E.cx = 0;
+    E.cy = 0;
+    E.rowoff = 0;
+    E.vrowoff = 0;
+    editorSetStatusMessage("%d hunk%s, +%d -%d | Ctrl-D = back", hunks, hunks == 1 ? "" : "s", added, removed);
 }
 
 //
@@ -601,18 +3132,53 @@ void abAppend(struct abuf *ab, const char *s, int len) {
 
 // Check if cursor has moved outside the visible window and if so adjust E.rowoff so that the cursor is just inside the visible window.
 void editorScroll() {
+    if (E.hex) {
+        // E.hexoff is moved to the start of its row in case the row width changed with the window size
+        int bpr = editorHexRowBytes();
+        long long top = E.hexoff / bpr;
+        long long cur = E.hexcx / bpr;
+        if (cur < top) top = cur;
+        if (cur >= top + E.screenrows) top = cur - E.screenrows + 1;
+        E.hexoff = top * bpr;
+        return;
+    }
+
+    // A search or goto that lands inside a collapsed fold opens it
+    if (E.cy < E.numrows && editorRowHidden(E.cy)) editorFoldRemove(editorFoldFind(E.cy));
+
     E.rx = 0;
     if (E.cy < E.numrows) {
         E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
     }
 
-    if (E.cy < E.rowoff) {
-        E.rowoff = E.cy;
+    if (E.wrap) {
+        // Same as below but in visual lines. E.rowoff is kept as the row at the top of the screen, so code that sets it to force a scroll still works.
+        int x;
+        int cv = indexPrefix(&E.wrapidx, E.cy) + editorWrapCursor(&x);
+        if (E.cy < E.rowoff || cv < E.vrowoff) {
+            E.vrowoff = cv;
+        }
+        if (cv >= E.vrowoff + E.screenrows) {
+            E.vrowoff = cv - E.screenrows + 1;
+        }
+        long long sub;
+        E.rowoff = indexFind(&E.wrapidx, E.vrowoff, &sub);
+        E.vrowsub = sub;
+        E.coloff = 0;
+        return;
+    }
+
+    // Rows are compared by the line they're drawn on, so a collapsed fold only counts as one
+    int top = editorVisibleIndex(E.rowoff);
+    int cur = editorVisibleIndex(E.cy);
+    if (cur < top) {
+        top = cur;
     }
-    if (E.cy >= E.rowoff + E.screenrows) {
-        E.rowoff = E.cy - E.screenrows + 1;
+    if (cur >= top + E.screenrows) {
+        top = cur - E.screenrows + 1;
     }
-    if (E.cx < E.coloff) {
+    E.rowoff = editorVisibleRow(top);
+    if (E.rx < E.coloff) {
         E.coloff = E.rx;
     }
     if (E.rx >= E.coloff + E.screencols) {
@@ -621,13 +3187,108 @@ void editorScroll() {
 }
 
 
+// Draw len characters of a row's render string starting at start, switching color only where the highlight changes. Bytes selfrom to selto-1 of render are selected and drawn inverted.
+void editorDrawRender(struct abuf *ab, erow *row, int start, int len, int selfrom, int selto, int *current_color) {
+    if (len <= 0) return;
+    int end = start + len;
+    if (E.syntax == NULL && (selto <= start || selfrom >= end)) {
+        abAppend(ab, &row->render[start], len);
+        return;
+    }
+    int inverse = 0;
+    int j = start;
+    while (j < end) {
+        int hl = E.syntax ? row->hl[j] : HL_NORMAL;
+        int sel = j >= selfrom && j < selto;
+        int color = hl == HL_NORMAL ? -1 : editorSyntaxToColor(hl);
+        if (color != *current_color) {
+            char buf[16];
+            int clen = color == -1 ? snprintf(buf, sizeof(buf), "\x1b[39m") : snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+            abAppend(ab, buf, clen);
+            *current_color = color;
+        }
+        if (sel != inverse) {
+            if (sel) abAppend(ab, "\x1b[7m", 4);
+            else abAppend(ab, "\x1b[27m", 5);
+            inverse = sel;
+        }
+        // Write the whole run of characters with the same highlight at once
+        int run = j + 1;
+        while (run < end && (E.syntax ? row->hl[run] : HL_NORMAL) == hl && (run >= selfrom && run < selto) == sel) run++;
+        abAppend(ab, &row->render[j], run - j);
+        j = run;
+    }
+    if (inverse) abAppend(ab, "\x1b[27m", 5);
+}
+
+// The part of a row's render string that is selected, or an empty range
+void editorRowSelection(int filerow, int *selfrom, int *selto) {
+    int sy, sx, ey, ex;
+    *selfrom = *selto = 0;
+    if (!editorSelectionBounds(&sy, &sx, &ey, &ex) || filerow < sy || filerow > ey) return;
+    erow *row = &E.row[filerow];
+    *selfrom = filerow == sy ? editorRenderColToByte(row, editorRowCxToRx(row, sx)) : 0;
+    *selto = filerow == ey ? editorRenderColToByte(row, editorRowCxToRx(row, ex)) : row->rsize;
+}
+
+// Draw bytes start to start+len-1 of a row's render string, with the selection and the extra cursors on the row in reverse video. A cursor at the end of the row is drawn as a block after it if there's room.
+void editorDrawRowPart(struct abuf *ab, int filerow, int start, int len, int room, int *current_color) {
+    erow *row = &E.row[filerow];
+    int selfrom, selto;
+    editorRowSelection(filerow, &selfrom, &selto);
+    int end = start + len;
+    int eol = 0;
+    int c;
+    for (c = editorFirstCursor(filerow); c < E.numcursors && E.cursors[c].cy == filerow; c++) {
+        int at = editorRenderColToByte(row, editorRowCxToRx(row, E.cursors[c].cx));
+        if (at == row->rsize) eol = 1;
+        if (at < start || at >= end) continue;
+        int cp, n = row->ascii ? 1 : utf8Decode(&row->render[at], row->rsize - at, &cp);
+        editorDrawRender(ab, row, start, at - start, selfrom, selto, current_color);
+        editorDrawRender(ab, row, at, n, at, at + n, current_color);
+        start = at + n;
+    }
+    editorDrawRender(ab, row, start, end - start, selfrom, selto, current_color);
+    if (eol && end == row->rsize && room) abAppend(ab, "\x1b[7m \x1b[27m", 10);
+}
+
+// Say how many lines are collapsed after the first row of a fold, in as much of the `room` columns left on the line as it fits in
+void editorDrawFoldMarker(struct abuf *ab, int filerow, int room, int *current_color) {
+    int f = editorFoldHeader(filerow);
+    if (f < 0 || room <= 0) return;
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), " ... %d lines", E.folds[f].end - E.folds[f].start);
+    if (len > room) len = room;
+    if (*current_color != 36) {
+        abAppend(ab, "\x1b[36m", 5);
+        *current_color = 36;
+    }
+    abAppend(ab, buf, len);
+}
+
 // Draws a ~ in each row, which means that row is not part of the file and can't contain any text
 void editorDrawRows(struct abuf *ab) {
+    // Only the rows on screen need highlighting. The color is tracked across rows so an escape sequence is only written when it changes.
+    editorHighlightRows(editorVisibleRow(editorVisibleIndex(E.rowoff) + E.screenrows - 1));
+    int current_color = -1;
+
+    // In wrap mode the screen starts part way into E.rowoff, and each row is drawn one screen-wide piece at a time
+    int filerow = E.rowoff;
+    int start = 0;
+    if (E.wrap && filerow < E.numrows) {
+        int sub;
+        for (sub = 0; sub < E.vrowsub; sub++)
+            start = editorRenderFit(&E.row[filerow], start, E.screencols);
+    }
+
     int y;
     for (y = 0; y < E.screenrows; y++) {
-        int filerow = y + E.rowoff;
         // Wrap our previosu row-draing code in an if that checks whether we are currently drawing a row that is part of the text buffer, or a row that comes after the end of the text buffer.
         if (filerow >= E.numrows) {
+            if (current_color != -1) {
+                abAppend(ab, "\x1b[39m", 5);
+                current_color = -1;
+            }
             // Only display welcome message if no argument given to specify file
             if (E.numrows == 0 && y == E.screenrows / 3) {
                 // Create welcome message
@@ -647,11 +3308,31 @@ void editorDrawRows(struct abuf *ab) {
             else {
                 abAppend(ab, "~", 1);
             }
+        } else if (E.wrap) {
+            erow *row = &E.row[filerow];
+            int end = editorRenderFit(row, start, E.screencols);
+            int room = editorRenderByteToCol(row, end) - editorRenderByteToCol(row, start) < E.screencols;
+            editorDrawRowPart(ab, filerow, start, end - start, room, &current_color);
+            // One column is kept free for a cursor drawn at the end of the row
+            int used = editorRenderByteToCol(row, end) - editorRenderByteToCol(row, start);
+            start = end;
+            if (start >= row->rsize) {
+                editorDrawFoldMarker(ab, filerow, E.screencols - used - 1, &current_color);
+                filerow = editorNextVisibleRow(filerow);
+                start = 0;
+            }
         } else {
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0) len = 0;
-            if (len > E.screencols) len = E.screencols;
-            abAppend(ab, &E.row[filerow].render[E.coloff], len);
+            // E.coloff is in screen columns, which only match bytes in ASCII rows
+            erow *row = &E.row[filerow];
+            int from = editorRenderColToByte(row, E.coloff);
+            // A wide character cut in half by the left edge is drawn as a space, so the rest of the row stays in its columns
+            int pad = editorRenderByteToCol(row, from) - E.coloff;
+            if (pad > 0) abAppend(ab, " ", pad);
+            int len = editorRenderFit(row, from, E.screencols - (pad > 0 ? pad : 0)) - from;
+            editorDrawRowPart(ab, filerow, from, len, row->rcols - E.coloff < E.screencols, &current_color);
+            int used = editorRenderByteToCol(row, from + len) - E.coloff;
+            editorDrawFoldMarker(ab, filerow, E.screencols - (used > 0 ? used : 0) - 1, &current_color);
+            filerow = editorNextVisibleRow(filerow);
         }
         
 
@@ -660,14 +3341,84 @@ void editorDrawRows(struct abuf *ab) {
         // If last line don't create new line
         abAppend(ab, "\r\n", 2);
     }
+    if (current_color != -1) abAppend(ab, "\x1b[39m", 5);
+}
+
+// Draw the hex view straight from the mapping. Only the bytes on screen are read, and patched bytes are looked up by walking the patch list from the first one on screen.
+void editorHexDrawRows(struct abuf *ab) {
+    int bpr = editorHexRowBytes();
+    int offw = editorHexOffsetWidth();
+    int p = editorHexFindPatch(E.hexoff);
+    int y;
+    for (y = 0; y < E.screenrows; y++) {
+        long long off = E.hexoff + (long long)y * bpr;
+        if (off >= E.mapsize) {
+            abAppend(ab, "~", 1);
+        } else {
+            int n = E.mapsize - off < bpr ? E.mapsize - off : bpr;
+            unsigned char bytes[KILO_HEX_ROW_BYTES];
+            int patched[KILO_HEX_ROW_BYTES];
+            memcpy(bytes, &E.map[off], n);
+            memset(patched, 0, sizeof(patched));
+            for (; p < E.numpatches && E.patches[p].offset < off + n; p++) {
+                bytes[E.patches[p].offset - off] = E.patches[p].byte;
+                patched[E.patches[p].offset - off] = 1;
+            }
+
+            char buf[32];
+            int len = snprintf(buf, sizeof(buf), "%0*llx  ", offw, off);
+            abAppend(ab, buf, len);
+            // Changed bytes are drawn in red, in both columns
+            int j;
+            for (j = 0; j < bpr; j++) {
+                if (j >= n) {
+                    abAppend(ab, "   ", 3);
+                    continue;
+                }
+                len = snprintf(buf, sizeof(buf), "%02x ", bytes[j]);
+                if (patched[j]) abAppend(ab, "\x1b[31m", 5);
+                abAppend(ab, buf, len);
+                if (patched[j]) abAppend(ab, "\x1b[39m", 5);
+            }
+            abAppend(ab, " ", 1);
+            for (j = 0; j < n; j++) {
+                char c = isprint(bytes[j]) ? bytes[j] : '.';
+                if (patched[j]) abAppend(ab, "\x1b[31m", 5);
+                abAppend(ab, &c, 1);
+                if (patched[j]) abAppend(ab, "\x1b[39m", 5);
+            }
+        }
+        abAppend(ab, "\x1b[K", 3);
+        abAppend(ab, "\r\n", 2);
+    }
 }
 
 void editorDrawStatusBar(struct abuf *ab) {
     abAppend(ab, "\x1b[7m", 4);
 
     char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No Name]", E.numrows, E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cy + 1, E.numrows);
+    char bufinfo[32] = "";
+    if (numbuffers > 1) snprintf(bufinfo, sizeof(bufinfo), "[%d/%d] ", curbuffer + 1, numbuffers);
+    char size[24];
+    if (E.hex) snprintf(size, sizeof(size), "%lld bytes", E.mapsize);
+    else snprintf(size, sizeof(size), "%d lines", E.numrows);
+    int len = snprintf(status, sizeof(status), "%s%.20s - %s %s", bufinfo, E.filename ? E.filename : "[No Name]", size, E.dirty ? "(modified)" : "");
+    // Where the cursor is: the row and byte offset, or just the offset in hex view
+    char pos[48];
+    if (E.hex) snprintf(pos, sizeof(pos), "hex | @%lld", editorCursorOffset());
+    else snprintf(pos, sizeof(pos), "%s | %d/%d @%lld", E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows, editorCursorOffset());
+    int rlen;
+    if (trace.overlay) {
+        // Stats of the previous frame, since the one being drawn hasn't been flushed yet
+        long heap = traceHeapUsage();
+        char heapstr[24];
+        if (heap < 0) snprintf(heapstr, sizeof(heapstr), "n/a");
+        else snprintf(heapstr, sizeof(heapstr), "%ldK", heap / 1024);
+        rlen = snprintf(rstatus, sizeof(rstatus), "%.2fms %dB heap %s | %s", trace.frame_us / 1000.0, trace.frame_bytes, heapstr, pos);
+    } else {
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s", pos);
+    }
+    if (rlen >= (int)sizeof(rstatus)) rlen = sizeof(rstatus) - 1;
     if (len > E.screencols) len = E.screencols;
     abAppend(ab, status, len);
 
@@ -694,7 +3445,11 @@ void editorDrawMessageBar(struct abuf *ab) {
 }
 
 void editorRefreshScreen() {
+    long long start = traceNow();
     editorScroll();
+    traceRecord(TRACE_SCROLL, start, -1);
+
+    start = traceNow();
     struct abuf ab = ABUF_INIT;
 
     // Hide cursor
@@ -703,20 +3458,40 @@ void editorRefreshScreen() {
     // Reposition cursor at top left of screen
     abAppend(&ab, "\x1b[H", 3);
 
-    editorDrawRows(&ab);
+    if (E.hex) editorHexDrawRows(&ab);
+    else editorDrawRows(&ab);
     editorDrawStatusBar(&ab);
     editorDrawMessageBar(&ab);
 
     // Move cursor to the position stored in E.cx and E.cy
+    int cury = editorVisibleIndex(E.cy) - editorVisibleIndex(E.rowoff);
+    int curx = E.rx - E.coloff;
+    if (E.wrap) {
+        cury = indexPrefix(&E.wrapidx, E.cy) + editorWrapCursor(&curx) - E.vrowoff;
+        if (curx >= E.screencols) curx = E.screencols - 1;
+    }
+    if (E.hex) {
+        int bpr = editorHexRowBytes();
+        cury = (E.hexcx - E.hexoff) / bpr;
+        curx = editorHexOffsetWidth() + 2 + (E.hexcx % bpr) * 3 + E.hexnibble;
+    }
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cury + 1, curx + 1);
     abAppend(&ab, buf, strlen(buf));
 
     // Show cursor
     abAppend(&ab, "\x1b[?25h", 6);
+    traceRecord(TRACE_DRAW, start, -1);
 
-
+    start = traceNow();
     write(STDOUT_FILENO, ab.b, ab.len);
+    traceRecord(TRACE_FLUSH, start, ab.len);
+
+    // A frame is everything from decoding the key that caused it until it's on the terminal
+    int i;
+    trace.frame_us = 0;
+    for (i = 0; i < TRACE_PHASES; i++) trace.frame_us += trace.phase[i];
+    trace.frame_bytes = ab.len;
     abFree(&ab);
 }
 
@@ -753,7 +3528,9 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
         int c = editorReadKey();
 
         if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-            if (buflen != 0) buf[--buflen] = '\0';
+            while (buflen != 0 && utf8IsContinuation(buf[buflen - 1])) buflen--;
+            if (buflen != 0) buflen--;
+            buf[buflen] = '\0';
         } else if (c == '\x1b') {
             editorSetStatusMessage("");
             if (callback) callback(buf, c);
@@ -765,7 +3542,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
                 if (callback) callback(buf, c);
                 return buf;
             }
-        } else if (!iscntrl(c) && c < 128) {
+        } else if (c < 256 && (c >= 128 || !iscntrl(c))) {
             if (buflen == bufsize - 1) {
                 bufsize *= 2;
                 buf = realloc(buf, bufsize);
@@ -786,29 +3563,30 @@ void editorMoveCursor(int key) {
     switch (key) {
       case ARROW_LEFT:
         if (E.cx != 0) {
-            E.cx--;
+            // Step over a whole UTF-8 character
+            do E.cx--; while (E.cx > 0 && utf8IsContinuation(row->chars[E.cx]));
         } else if (E.cy > 0) {
-            E.cy--;
+            E.cy = editorPrevVisibleRow(E.cy);
             E.cx = E.row[E.cy].size;
         }
         break;
       case ARROW_RIGHT:
         if (row && E.cx < row->size) {
-            E.cx++;
+            do E.cx++; while (E.cx < row->size && utf8IsContinuation(row->chars[E.cx]));
         } else if (row && E.cx == row->size) {
-            E.cy++;
+            E.cy = editorNextVisibleRow(E.cy);
             E.cx = 0;
         }
         break;
       case ARROW_UP:
         if (E.cy != 0) {
-            E.cy--;
+            E.cy = editorPrevVisibleRow(E.cy);
         }
         break;
       case ARROW_DOWN:
         // Not allow cursor to advance past the bottom of screen
         if (E.cy < E.numrows) {
-            E.cy++;
+            E.cy = editorNextVisibleRow(E.cy);
         }
         break;
     }
@@ -818,24 +3596,150 @@ void editorMoveCursor(int key) {
     if (E.cx > rowlen) {
         E.cx = rowlen;
     }
+    // Moving up or down keeps the byte position, which might be in the middle of a character on the new row
+    while (row && E.cx > 0 && E.cx < rowlen && utf8IsContinuation(row->chars[E.cx])) E.cx--;
+}
+
+
+// Keys of the hex view. Returns 0 for the keys that work the same in every view (save, quit, goto, buffers and the overlay), which are left to editorProcessKeypress.
+int editorHexProcessKey(int c) {
+    int bpr = editorHexRowBytes();
+    long long last = E.mapsize > 0 ? E.mapsize - 1 : 0;
+    switch (c) {
+        case CTRL_KEY('q'):
+        case CTRL_KEY('s'):
+        case CTRL_KEY('g'):
+        case CTRL_KEY('o'):
+        case CTRL_KEY('b'):
+        case CTRL_KEY('t'):
+            return 0;
+
+        case ARROW_LEFT:
+            if (E.hexnibble) E.hexnibble = 0;
+            else if (E.hexcx > 0) E.hexcx--;
+            break;
+        case ARROW_RIGHT:
+            if (E.hexcx < last) E.hexcx++;
+            E.hexnibble = 0;
+            break;
+        case ARROW_UP:
+            if (E.hexcx >= bpr) E.hexcx -= bpr;
+            break;
+        case ARROW_DOWN:
+            if (E.hexcx + bpr <= last) E.hexcx += bpr;
+            break;
+        case PAGE_UP:
+            if (E.hexcx >= (long long)bpr * E.screenrows) E.hexcx -= (long long)bpr * E.screenrows;
+            else E.hexcx %= bpr;
+            break;
+        case PAGE_DOWN:
+            E.hexcx += (long long)bpr * E.screenrows;
+            if (E.hexcx > last) E.hexcx = last;
+            break;
+        case HOME_KEY:
+            E.hexcx -= E.hexcx % bpr;
+            E.hexnibble = 0;
+            break;
+        case END_KEY:
+            E.hexcx += bpr - 1 - E.hexcx % bpr;
+            if (E.hexcx > last) E.hexcx = last;
+            E.hexnibble = 0;
+            break;
+
+        case '\x1b':
+            break;
+
+        default:
+            // Typing a hex digit overwrites the nibble under the cursor and moves on. Bytes are never inserted or deleted, so the file keeps its size and offsets.
+            if (c < 128 && isxdigit(c)) {
+                if (E.mapsize == 0) break;
+                int v = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+                unsigned char b = editorHexByte(E.hexcx);
+                if (E.hexnibble) b = (b & 0xf0) | v;
+                else b = (b & 0x0f) | (v << 4);
+                editorHexSetByte(E.hexcx, b);
+                if (!E.hexnibble) {
+                    E.hexnibble = 1;
+                } else {
+                    E.hexnibble = 0;
+                    if (E.hexcx < last) E.hexcx++;
+                }
+            } else {
+                editorSetStatusMessage("Hex view: type hex digits to overwrite bytes");
+            }
+            break;
+    }
+    return 1;
 }
 
+// Keys while there are extra cursors. Typing and deleting happen at every cursor as one edit, and moving along the row moves all of them. Returns 0 for keys that are handled as usual, after dropping the extra cursors for the ones that only make sense with one.
+int editorMultiProcessKey(int c) {
+    switch (c) {
+        case CTRL_KEY('n'):
+        case CTRL_KEY('a'):
+        case CTRL_KEY('z'):
+        case CTRL_KEY('s'):
+        case CTRL_KEY('q'):
+        case CTRL_KEY('t'):
+            return 0;
+
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+            editorMultiEdit(MULTI_BACKSPACE, NULL, 0);
+            return 1;
+
+        case DEL_KEY:
+            editorMultiEdit(MULTI_DELETE, NULL, 0);
+            return 1;
+
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case HOME_KEY:
+        case END_KEY:
+            editorMultiMove(c);
+            return 1;
+
+        case '\x1b':
+            editorClearCursors();
+            return 1;
+    }
+    if (c == '\t' || (c < 256 && (c >= 128 || !iscntrl(c)))) {
+        // Read the rest of a UTF-8 character, so that it goes in and is undone as one
+        char s[4];
+        int len = 1;
+        int need = (c & 0xe0) == 0xc0 ? 2 : (c & 0xf0) == 0xe0 ? 3 : (c & 0xf8) == 0xf0 ? 4 : 1;
+        s[0] = c;
+        while (len < need) s[len++] = editorReadKey();
+        editorMultiEdit(MULTI_INSERT, s, len);
+        return 1;
+    }
+    editorClearCursors();
+    return 0;
+}
 
 void editorProcessKeypress() {
     static int quit_times = KILO_QUIT_TIMES;
 
     int c = editorReadKey();
+    long long start = traceNow();
+    if ((E.hex && editorHexProcessKey(c)) || (E.numcursors > 0 && editorMultiProcessKey(c))) {
+        quit_times = KILO_QUIT_TIMES;
+        traceRecord(TRACE_EDIT, start, -1);
+        return;
+    }
     switch (c) {
 
         // Enter Key
         case '\r':
+            E.selecting = 0;
             editorInsertNewLine();
             break;
 
         case CTRL_KEY('q'):
-            if (E.dirty && quit_times > 0) {
+            if (editorAnyDirty() && quit_times > 0) {
                 editorSetStatusMessage("WARNING!!! File has unsaved changes. " "Press Ctrl-Q %d more times to quit.", quit_times);
                 quit_times--;
+                traceRecord(TRACE_EDIT, start, -1);
                 return;
             }
             write(STDOUT_FILENO, "\x1b[2J", 4);
@@ -860,21 +3764,94 @@ void editorProcessKeypress() {
             editorFind();
             break;
 
+        case CTRL_KEY('g'):
+            editorGoto();
+            break;
+
+        case CTRL_KEY('o'):
+            editorOpenBuffer();
+            break;
+
+        case CTRL_KEY('b'):
+            editorNextBuffer();
+            break;
+
+        case CTRL_KEY('d'):
+            editorDiff();
+            break;
+
+        case CTRL_KEY('n'):
+            editorAddCursors();
+            break;
+
+        case CTRL_KEY('a'):
+            editorAddCursorsAtMatches();
+            break;
+
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+
+        case CTRL_KEY('r'):
+            editorToggleFold();
+            break;
+
+        case CTRL_KEY('t'):
+            trace.overlay = !trace.overlay;
+            break;
+
+        // Start a new selection at the cursor, like setting a mark
+        case CTRL_KEY('k'):
+            E.selecting = 1;
+            E.selx = E.cx;
+            E.sely = E.cy;
+            editorSetStatusMessage("Selecting: Ctrl-C = copy | Ctrl-X = cut | ESC = cancel");
+            break;
+
+        case CTRL_KEY('c'):
+            editorCopy();
+            break;
+
+        case CTRL_KEY('x'):
+            editorCut();
+            break;
+
+        case CTRL_KEY('v'):
+            editorPaste();
+            break;
+
+        case CTRL_KEY('w'):
+            E.wrap = !E.wrap;
+            E.vrowoff = 0;
+            E.rowoff = E.numrows;
+            editorSetStatusMessage("Soft wrap %s", E.wrap ? "on" : "off");
+            break;
+
         case BACKSPACE:
         // Backspace character (original ctrl h back in old days)
         case CTRL_KEY('h'):
         case DEL_KEY:
+            E.selecting = 0;
             if (c == DEL_KEY) editorMoveCursor(ARROW_RIGHT);
             editorDelChar();
             break;
         
         case PAGE_UP:
         case PAGE_DOWN:
+            if (E.wrap) {
+                // Page by screen lines, looking up the row a screen away rather than stepping through the rows in between
+                long long target = c == PAGE_UP ? E.vrowoff - E.screenrows : E.vrowoff + 2 * E.screenrows - 1;
+                if (target < 0) target = 0;
+                E.cy = indexFind(&E.wrapidx, target, NULL);
+                int rowlen = E.cy < E.numrows ? E.row[E.cy].size : 0;
+                if (E.cx > rowlen) E.cx = rowlen;
+                break;
+            }
             {
                 if (c == PAGE_UP) {
                     E.cy = E.rowoff;
                 } else if (c == PAGE_DOWN) {
-                    E.cy = E.rowoff + E.screenrows - 1;
+                    E.cy = editorVisibleRow(editorVisibleIndex(E.rowoff) + E.screenrows - 1);
                     if (E.cy > E.numrows) E.cy = E.numrows;
                 }
 
@@ -893,15 +3870,311 @@ void editorProcessKeypress() {
 
         // Ctrl - l is originally to refresh screen but our editor does that already
         case CTRL_KEY('l'):
+            break;
+
         case '\x1b':
+            E.selecting = 0;
             break;
 
         default:
             // If keyboard press not mapped to something write to file
+            E.selecting = 0;
             editorInsertChar(c);
             break;
     }
     quit_times = KILO_QUIT_TIMES;
+    traceRecord(TRACE_EDIT, start, -1);
+}
+
+//
+//
+/************* batch mode *************/
+//
+//
+
+// Batch mode (kilo -e script file) edits a file without a terminal. The file is streamed through line by line, so only the current line is ever in memory and nothing is rendered.
+// Line numbers in the script always refer to lines of the input file, and can only move forward.
+enum batchCmdType {
+    BATCH_INSERT,
+    BATCH_DELETE
+};
+
+struct batchCmd {
+    int type;
+    // Insert before line `line`, or delete lines `line` through `end`
+    long line;
+    long end;
+    char *text;
+    // Line of the script it came from, for errors found while the file is streamed
+    int lineno;
+};
+
+struct batchReplace {
+    char *from;
+    size_t fromlen;
+    char *to;
+    size_t tolen;
+};
+
+struct batchScript {
+    struct batchCmd *cmds;
+    int ncmds;
+    struct batchReplace *reps;
+    int nreps;
+};
+
+void batchError(const char *script, int lineno, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "kilo: %s:%d: ", script, lineno);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+}
+
+// Parse a line number argument, returning -1 if it isn't a positive number
+long batchParseLine(char **p) {
+    char *end;
+    while (**p == ' ') (*p)++;
+    if (!isdigit((unsigned char)**p)) return -1;
+    long n = strtol(*p, &end, 10);
+    *p = end;
+    return n > 0 ? n : -1;
+}
+
+void batchAddCmd(struct batchScript *bs, int type, long line, long end, char *text, int lineno) {
+    bs->cmds = realloc(bs->cmds, sizeof(struct batchCmd) * (bs->ncmds + 1));
+    bs->cmds[bs->ncmds].lineno = lineno;
+    bs->cmds[bs->ncmds].type = type;
+    bs->cmds[bs->ncmds].line = line;
+    bs->cmds[bs->ncmds].end = end;
+    bs->cmds[bs->ncmds].text = text ? strdup(text) : NULL;
+    bs->ncmds++;
+}
+
+// Read a script (or stdin if the name is "-"). One command per line:
+//   goto N              move to line N
+//   insert TEXT         insert TEXT as a new line before the current line
+//   delete N [M]        delete lines N through M, then move to the line after them
+//   replace /FROM/TO/   replace FROM with TO on every line of the file, any delimiter can be used
+// Blank lines and lines starting with '#' are ignored.
+int batchParse(const char *script, struct batchScript *bs) {
+    FILE *fp = strcmp(script, "-") == 0 ? stdin : fopen(script, "r");
+    if (!fp) {
+        fprintf(stderr, "kilo: %s: %s\n", script, strerror(errno));
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    int lineno = 0;
+    long cur = 1;
+    int err = 0;
+    while (!err && (linelen = getline(&line, &linecap, fp)) != -1) {
+        lineno++;
+        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+            line[--linelen] = '\0';
+        if (linelen == 0 || line[0] == '#') continue;
+
+        char *p = line;
+        if (strncmp(p, "goto ", 5) == 0) {
+            p += 5;
+            long n = batchParseLine(&p);
+            while (*p == ' ') p++;
+            if (n == -1 || *p) {
+                batchError(script, lineno, "goto needs a line number");
+                err = 1;
+            } else if (n < cur) {
+                batchError(script, lineno, "goto %ld moves backwards (already at line %ld)", n, cur);
+                err = 1;
+            } else {
+                cur = n;
+            }
+        } else if (strncmp(p, "insert ", 7) == 0 || strcmp(p, "insert") == 0) {
+            batchAddCmd(bs, BATCH_INSERT, cur, cur, linelen > 7 ? p + 7 : "", lineno);
+        } else if (strncmp(p, "delete ", 7) == 0) {
+            p += 7;
+            long first = batchParseLine(&p);
+            long last = first;
+            while (*p == ' ') p++;
+            if (*p) last = batchParseLine(&p);
+            while (*p == ' ') p++;
+            if (first == -1 || last == -1 || last < first || *p) {
+                batchError(script, lineno, "delete needs a line range");
+                err = 1;
+            } else if (first < cur) {
+                batchError(script, lineno, "delete %ld moves backwards (already at line %ld)", first, cur);
+                err = 1;
+            } else {
+                batchAddCmd(bs, BATCH_DELETE, first, last, NULL, lineno);
+                cur = last + 1;
+            }
+        } else if (strncmp(p, "replace ", 8) == 0 && linelen > 8) {
+            p += 8;
+            char delim = *p++;
+            char *mid = strchr(p, delim);
+            char *end = mid ? strchr(mid + 1, delim) : NULL;
+            if (!end || mid == p) {
+                batchError(script, lineno, "replace needs the form replace /from/to/");
+                err = 1;
+            } else {
+                struct batchReplace r;
+                r.fromlen = mid - p;
+                r.from = strndup(p, r.fromlen);
+                r.tolen = end - mid - 1;
+                r.to = strndup(mid + 1, r.tolen);
+                bs->reps = realloc(bs->reps, sizeof(struct batchReplace) * (bs->nreps + 1));
+                bs->reps[bs->nreps++] = r;
+            }
+        } else {
+            batchError(script, lineno, "unknown command: %s", line);
+            err = 1;
+        }
+    }
+    free(line);
+    if (fp != stdin) fclose(fp);
+    return err ? -1 : 0;
+}
+
+void batchFree(struct batchScript *bs) {
+    int j;
+    for (j = 0; j < bs->ncmds; j++) free(bs->cmds[j].text);
+    for (j = 0; j < bs->nreps; j++) {
+        free(bs->reps[j].from);
+        free(bs->reps[j].to);
+    }
+    free(bs->cmds);
+    free(bs->reps);
+}
+
+// Apply every replacement to one line. Returns the line itself when nothing matched, otherwise the rewritten line in ab.
+char *batchReplaceLine(struct batchScript *bs, char *line, size_t *len, struct abuf *ab) {
+    int j;
+    for (j = 0; j < bs->nreps; j++) {
+        struct batchReplace *r = &bs->reps[j];
+        char *match = memmem(line, *len, r->from, r->fromlen);
+        if (!match) continue;
+
+        struct abuf out = ABUF_INIT;
+        char *p = line;
+        size_t left = *len;
+        while (match) {
+            abAppend(&out, p, match - p);
+            abAppend(&out, r->to, r->tolen);
+            left -= (match - p) + r->fromlen;
+            p = match + r->fromlen;
+            match = memmem(p, left, r->from, r->fromlen);
+        }
+        abAppend(&out, p, left);
+        abFree(ab);
+        *ab = out;
+        line = ab->b ? ab->b : "";
+        *len = ab->len;
+    }
+    return line;
+}
+
+int editorBatch(const char *script, const char *filename) {
+    struct batchScript bs = {NULL, 0, NULL, 0};
+    if (batchParse(script, &bs) == -1) {
+        batchFree(&bs);
+        return 1;
+    }
+
+    // A file that doesn't exist yet is edited as an empty file, like opening it interactively and saving
+    struct stat st;
+    FILE *in = fopen(filename, "r");
+    if (!in && errno != ENOENT) {
+        fprintf(stderr, "kilo: %s: %s\n", filename, strerror(errno));
+        batchFree(&bs);
+        return 1;
+    }
+    mode_t mode = (in && fstat(fileno(in), &st) == 0) ? st.st_mode & 07777 : 0644;
+
+    // Write to a temporary file next to the original and rename it over the original, so a failed run leaves the file untouched
+    size_t tmplen = strlen(filename) + 8;
+    char *tmpname = malloc(tmplen);
+    snprintf(tmpname, tmplen, "%s.XXXXXX", filename);
+    int fd = mkstemp(tmpname);
+    FILE *out = fd != -1 ? fdopen(fd, "w") : NULL;
+    if (!out) {
+        fprintf(stderr, "kilo: %s: %s\n", tmpname, strerror(errno));
+        if (fd != -1) close(fd);
+        if (in) fclose(in);
+        free(tmpname);
+        batchFree(&bs);
+        return 1;
+    }
+    fchmod(fd, mode);
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen = 0;
+    long lineno = 0;
+    int next = 0;
+    struct abuf ab = ABUF_INIT;
+    // Lines keep the terminator they had, so lines the script doesn't touch come out byte for byte the same. Inserted lines get the first terminator in the file.
+    char eol[3] = "\n";
+    int haveeol = 0;
+    // Whether the last line written has no terminator, as the last line of a file may not. A line inserted after it goes on a new line and takes its place as the unterminated last line.
+    int unterminated = 0;
+    // A delete of lines the file doesn't have. The file is left as it was.
+    int pastend = 0;
+    while (1) {
+        if (in) linelen = getline(&line, &linecap, in);
+        int eof = !in || linelen == -1;
+        lineno++;
+
+        // Strip the terminator, remembering the first one before anything is inserted
+        size_t full = eof ? 0 : linelen;
+        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+            linelen--;
+        if (!eof && !haveeol && full > (size_t)linelen) {
+            haveeol = 1;
+            if (full - linelen >= 2 && line[full - 2] == '\r') strcpy(eol, "\r\n");
+        }
+
+        // Inserts before this line, or at the end of the file for anything past the last line
+        int skip = 0;
+        while (next < bs.ncmds && (eof || bs.cmds[next].line <= lineno)) {
+            struct batchCmd *cmd = &bs.cmds[next];
+            if (cmd->type == BATCH_INSERT) {
+                if (unterminated) fputs(eol, out);
+                fputs(cmd->text, out);
+                if (!unterminated) fputs(eol, out);
+                next++;
+            } else if (eof) {
+                batchError(script, cmd->lineno, "delete %ld goes past the end of the file (%ld lines)", cmd->end, lineno - 1);
+                pastend = 1;
+                break;
+            } else {
+                skip = 1;
+                if (cmd->end == lineno) next++;
+                break;
+            }
+        }
+        if (eof) break;
+        if (skip) continue;
+
+        size_t len = linelen;
+        char *text = batchReplaceLine(&bs, line, &len, &ab);
+        fwrite(text, 1, len, out);
+        fwrite(line + linelen, 1, full - linelen, out);
+        unterminated = full == (size_t)linelen;
+    }
+    abFree(&ab);
+    free(line);
+    if (in) fclose(in);
+    batchFree(&bs);
+
+    int failed = ferror(out);
+    if (fclose(out) != 0) failed = 1;
+    if (!failed && !pastend && rename(tmpname, filename) == -1) failed = 1;
+    if (failed) fprintf(stderr, "kilo: %s: %s\n", filename, strerror(errno));
+    if (failed || pastend) unlink(tmpname);
+    free(tmpname);
+    return failed || pastend ? 1 : 0;
 }
 
 //
@@ -911,36 +4184,66 @@ void editorProcessKeypress() {
 //
 
 void initEditor() {
-    E.cx = 0;
-    E.cy = 0;
-    E.rx = 0;
-    // Keep track of scroller to view lines. Default to 0 so scrolled to top by default
-    E.rowoff = 0;
-    E.coloff = 0;
-    // For now editor will only display a single line of text, and so numrows can be either 0 or 1
-    E.numrows = 0;
-    E.row = NULL;
-    E.dirty = 0;
-    E.filename = NULL;
+    initBuffer();
+    buffers = malloc(sizeof(struct editorConfig));
+    numbuffers = 1;
+    curbuffer = 0;
     // Initialize E.statusmsg to an empty string so the message will be displayed by default
     E.statusmsg[0] = '\0';
     // E.statusmsg_time will contain the timestamp when e set a status message.
     E.statusmsg_time = 0;
     if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
     E.screenrows -=2;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleSigWinch;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGWINCH, &sa, NULL);
+}
+
+// Called after a SIGWINCH. Every row's wrapped line count depends on the width.
+void editorHandleResize() {
+    if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+    E.screenrows -= 2;
+    indexInvalidate(&E.wrapidx);
+    int j;
+    for (j = 0; j < numbuffers; j++)
+        if (j != curbuffer) indexInvalidate(&buffers[j].wrapidx);
 }
 
 int main(int argc, char *argv[]) {
+    // Batch mode never touches the terminal
+    if (argc >= 2 && strcmp(argv[1], "-e") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "Usage: kilo -e script file\n");
+            return 1;
+        }
+        return editorBatch(argv[2], argv[3]);
+    }
+
+    int first = 1;
+    if (argc >= 2 && strcmp(argv[1], "-x") == 0) {
+        force_hex = 1;
+        first = 2;
+    }
+
     // Disbale the echo feature
     enableRawMode();
+    traceInit();
     initEditor();
-    // If arguments to specify a file to edit
-    if (argc >= 2) {
-        // EditorOpen will eventually be for opening and reading a file from disk so we put in a new file i/o section
-        editorOpen(argv[1]);
+    // If arguments to specify a file to edit. Every file gets its own buffer, and we start on the first one.
+    if (argc > first) {
+        int j;
+        for (j = first; j < argc; j++) {
+            if (j > first) editorNewBuffer();
+            // EditorOpen will eventually be for opening and reading a file from disk so we put in a new file i/o section
+            editorOpen(argv[j]);
+        }
+        editorSwitchBuffer(0);
     }
     
-    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-W = wrap");
 
     // Read STDIN and save to char c variable. If variable is q then quit. Runs infinitely.
     while (1) {